@@ -22,6 +22,59 @@
 #include "neigh.h"
 #include "maint-buf.h"
 
+#ifdef __KERNEL__
+/* ACK state per neighbor when selective ACKs are used, in LRU order */
+static TBL(ack_tbl, ACK_TBL_MAX_LEN);
+static DSRUUTimer ack_tbl_timer;
+#endif
+
+struct ack_entry {
+	list_t l;
+	struct in_addr neigh;
+	unsigned short id;	/* Highest id received in sequence */
+	u_int32_t bitmap;	/* Ids received above it, as in the SACK option */
+	int pending;		/* An ACK is to be sent at "expires" */
+	struct timeval expires;
+	struct timeval last_req;	/* Last ACK REQ from the neighbor */
+};
+
+static inline int crit_neigh(void *pos, void *data)
+{
+	struct ack_entry *e = (struct ack_entry *)pos;
+	struct in_addr *neigh = (struct in_addr *)data;
+
+	if (e->neigh.s_addr == neigh->s_addr)
+		return 1;
+	return 0;
+}
+
+/* Record a received ACK REQ id. The cumulative id is advanced over ids
+ * received in sequence. A gap too large for the bitmap is given up on. An
+ * id far behind means the neighbor has started over, e.g., after its
+ * neighbor entry for us expired. */
+static void ack_entry_update(struct ack_entry *e, unsigned short id)
+{
+	short d = (short)(id - e->id);
+
+	if (d <= -DSR_SACK_BITS || d >= DSR_SACK_BITS) {
+		e->id = id;
+		e->bitmap = 0;
+		return;
+	}
+
+	/* Duplicate or reordered */
+	if (d <= 0)
+		return;
+
+	e->bitmap |= (1U << d);
+
+	while (e->bitmap & 2) {
+		e->id++;
+		e->bitmap >>= 1;
+	}
+	e->bitmap &= ~1;
+}
+
 struct dsr_ack_opt *dsr_ack_opt_add(char *buf, int len, struct in_addr src,
 				    struct in_addr dst, unsigned short id)//添加
 {
@@ -39,10 +92,43 @@ struct dsr_ack_opt *dsr_ack_opt_add(char *buf, int len, struct in_addr src,
 	return ack;
 }
 
+static struct dsr_sack_opt *dsr_sack_opt_add(char *buf, int len,
+					     struct in_addr src,
+					     struct in_addr dst,
+					     unsigned short id,
+					     u_int32_t bitmap)
+{
+	struct dsr_sack_opt *sack = (struct dsr_sack_opt *)buf;
+
+	if (len < (int)DSR_SACK_HDR_LEN)
+		return NULL;
+
+	sack->type = DSR_OPT_SACK;
+	sack->length = DSR_SACK_OPT_LEN;
+	sack->id = htons(id);
+	sack->dst = dst.s_addr;
+	sack->src = src.s_addr;
+	sack->bitmap = htonl(bitmap);
+
+	return sack;
+}
+
 int NSCLASS dsr_ack_send(struct in_addr dst, unsigned short id)//发送
+{
+	return __dsr_ack_send(dst, id, 0, DSR_OPT_ACK);
+}
+
+int NSCLASS dsr_sack_send(struct in_addr dst, unsigned short id,
+			  u_int32_t bitmap)
+{
+	return __dsr_ack_send(dst, id, bitmap, DSR_OPT_SACK);
+}
+
+int NSCLASS __dsr_ack_send(struct in_addr dst, unsigned short id,
+			   u_int32_t bitmap, int type)
 {
 	struct dsr_pkt *dp;
-	struct dsr_ack_opt *ack_opt;
+	void *ack_opt;
 	int len;
 	char *buf;
 
@@ -53,7 +139,8 @@ int NSCLASS dsr_ack_send(struct in_addr dst, unsigned short id)//发送
 /* 		return -1; */
 /* 	} */
 
-	len = DSR_OPT_HDR_LEN + /* DSR_SRT_OPT_LEN(srt) +  */ DSR_ACK_HDR_LEN;//头长度之和
+	len = DSR_OPT_HDR_LEN + /* DSR_SRT_OPT_LEN(srt) +  */ 
+	    (type == DSR_OPT_SACK ? DSR_SACK_HDR_LEN : DSR_ACK_HDR_LEN);//头长度之和
 
 	dp = dsr_pkt_alloc(NULL);
 
@@ -95,14 +182,19 @@ int NSCLASS dsr_ack_send(struct in_addr dst, unsigned short id)//发送
 /* 	buf += DSR_SRT_OPT_LEN(dp->srt); */
 /* 	len -= DSR_SRT_OPT_LEN(dp->srt); */
 
-	ack_opt = dsr_ack_opt_add(buf, len, dp->src, dp->dst, id);
+	if (type == DSR_OPT_SACK)
+		ack_opt = dsr_sack_opt_add(buf, len, dp->src, dp->dst, id,
+					   bitmap);
+	else
+		ack_opt = dsr_ack_opt_add(buf, len, dp->src, dp->dst, id);
 
 	if (!ack_opt) {
 		DEBUG("Could not create DSR ACK opt header\n");
 		goto out_err;
 	}
 
-	DEBUG("Sending ACK to %s id=%u\n", print_ip(dst), id);//描述发送
+	DEBUG("Sending ACK to %s id=%u bitmap=0x%x\n", print_ip(dst), id,
+	      bitmap);//描述发送
 
 	dp->flags |= PKT_XMIT_JITTER;
 
@@ -164,8 +256,8 @@ dsr_ack_req_opt_add(struct dsr_pkt *dp, unsigned short id)
 	if (!dsr_pkt_opts_len(dp)) {
 
 		buf =
-		    dsr_pkt_alloc_opts(dp,
-				       DSR_OPT_HDR_LEN + DSR_ACK_REQ_HDR_LEN);
+		    dsr_pkt_alloc_opts_reserve(dp, DSR_OPT_HDR_LEN +
+					       DSR_ACK_REQ_HDR_LEN, 0);
 		DEBUG("Allocating options for ACK REQ\n");//为ACK REQ分配选择
 		if (!buf)
 			return NULL;
@@ -267,8 +359,6 @@ int NSCLASS dsr_ack_req_opt_recv(struct dsr_pkt *dp, struct dsr_ack_req_opt *ack
 	if (!ack_req_opt || !dp || dp->flags & PKT_PROMISC_RECV)
 		return DSR_PKT_ERROR;
 
-	dp->ack_req_opt = ack_req_opt;
-
 	id = ntohs(ack_req_opt->id);
 
 	if (!dp->srt_opt)
@@ -277,7 +367,9 @@ int NSCLASS dsr_ack_req_opt_recv(struct dsr_pkt *dp, struct dsr_ack_req_opt *ack
 	DEBUG("src=%s prv=%s id=%u\n",
 	      print_ip(dp->src), print_ip(dp->prv_hop), id);
 
-	dsr_ack_send(dp->prv_hop, id);
+	if ((!ConfVal(UseSelectiveAck) && !ConfVal(AckPiggyback)) ||
+	    ack_tbl_add_id(dp->prv_hop, id) < 0)
+		dsr_ack_send(dp->prv_hop, id);
 
 	return DSR_PKT_NONE;
 }
@@ -303,9 +395,245 @@ int NSCLASS dsr_ack_opt_recv(struct dsr_ack_opt *ack)
 		return DSR_PKT_ERROR;
 
 	/* Purge packets buffered for this next hop */
-	n = maint_buf_del_all_id(src, id);
+	if (ack->type == DSR_OPT_SACK)
+		n = maint_buf_del_sack(src, id,
+				       ntohl(((struct dsr_sack_opt *)ack)->bitmap));
+	else
+		n = maint_buf_del_all_id(src, id);
 
 	DEBUG("Removed %d packets from maint buf\n", n);
 
 	return DSR_PKT_NONE;
 }
+
+/* Note an ACK REQ from a neighbor. The ACK is sent after AckCoalesceTime,
+ * covering all ACK REQs received from the neighbor in the meantime, unless
+ * it is piggybacked on a packet to the neighbor before that. */
+int NSCLASS ack_tbl_add_id(struct in_addr neigh, unsigned short id)
+{
+	struct ack_entry *e;
+	struct timeval now;
+	int arm = 0;
+
+	gettime(&now);
+
+	DSR_WRITE_LOCK(&ack_tbl.lock);
+
+	e = (struct ack_entry *)__tbl_find(&ack_tbl, &neigh, crit_neigh);
+
+	if (e) {
+		__tbl_detach(&ack_tbl, &e->l);
+
+		/* After a long pause the old cumulative id means nothing */
+		if ((usecs_t)timeval_diff(&now, &e->last_req) >
+		    ConfValToUsecs(NeighborTimeout)) {
+			e->id = id;
+			e->bitmap = 0;
+		} else
+			ack_entry_update(e, id);
+	} else {
+		/* Reuse the least recently used entry if it has nothing to
+		 * send */
+		if (TBL_FULL(&ack_tbl)) {
+			e = (struct ack_entry *)TBL_FIRST(&ack_tbl);
+
+			if (e->pending) {
+				DSR_WRITE_UNLOCK(&ack_tbl.lock);
+				return -1;
+			}
+			__tbl_detach(&ack_tbl, &e->l);
+		} else {
+			e = (struct ack_entry *)MALLOC(sizeof(*e), GFP_ATOMIC);
+
+			if (!e) {
+				DSR_WRITE_UNLOCK(&ack_tbl.lock);
+				return -1;
+			}
+		}
+		e->neigh = neigh;
+		e->id = id;
+		e->bitmap = 0;
+		e->pending = 0;
+	}
+	e->last_req = now;
+
+	if (!e->pending) {
+		e->pending = 1;
+		e->expires = now;
+		timeval_add_usecs(&e->expires, ConfValToUsecs(AckCoalesceTime));
+		arm = !timer_pending(&ack_tbl_timer);
+	}
+	__tbl_add_tail(&ack_tbl, &e->l);
+
+	DSR_WRITE_UNLOCK(&ack_tbl.lock);
+
+	if (arm)
+		set_timer(&ack_tbl_timer, &e->expires);
+
+	return 0;
+}
+
+void NSCLASS ack_tbl_timeout(unsigned long data)
+{
+	struct {
+		struct in_addr neigh;
+		unsigned short id;
+		u_int32_t bitmap;
+	} acks[ACK_TBL_MAX_LEN];
+	struct timeval now, expires;
+	list_t *pos, *tmp;
+	int i, n = 0, rearm = 0;
+
+	gettime(&now);
+
+	DSR_WRITE_LOCK(&ack_tbl.lock);
+
+	list_for_each_safe(pos, tmp, &ack_tbl.head) {
+		struct ack_entry *e = (struct ack_entry *)pos;
+
+		if (!e->pending) {
+			/* Expire idle neighbors */
+			if ((usecs_t)timeval_diff(&now, &e->last_req) >
+			    ConfValToUsecs(NeighborTimeout)) {
+				__tbl_detach(&ack_tbl, &e->l);
+				FREE(e);
+			}
+			continue;
+		}
+
+		if (timeval_diff(&e->expires, &now) > 0) {
+			if (!rearm || timeval_diff(&e->expires, &expires) < 0)
+				expires = e->expires;
+			rearm = 1;
+			continue;
+		}
+		acks[n].neigh = e->neigh;
+		acks[n].id = e->id;
+		acks[n].bitmap = e->bitmap;
+		e->pending = 0;
+		n++;
+	}
+	DSR_WRITE_UNLOCK(&ack_tbl.lock);
+
+	for (i = 0; i < n; i++) {
+		if (acks[i].bitmap)
+			dsr_sack_send(acks[i].neigh, acks[i].id,
+				      acks[i].bitmap);
+		else
+			dsr_ack_send(acks[i].neigh, acks[i].id);
+	}
+
+	if (rearm)
+		set_timer(&ack_tbl_timer, &expires);
+}
+
+/* Add the pending ACK for the next hop, if any, to an outgoing packet. A
+ * plain ACK is used unless there are ids to acknowledge selectively. */
+int NSCLASS dsr_ack_piggyback(struct dsr_pkt *dp)
+{
+	struct ack_entry *e;
+	struct in_addr myaddr;
+	unsigned short id;
+	u_int32_t bitmap;
+	int len;
+	char *buf;
+
+	if (!ConfVal(AckPiggyback) || !dp->dh.raw ||
+	    dp->nxt_hop.s_addr == DSR_BROADCAST)
+		return 0;
+
+	DSR_WRITE_LOCK(&ack_tbl.lock);
+
+	e = (struct ack_entry *)__tbl_find(&ack_tbl, &dp->nxt_hop, crit_neigh);
+
+	if (!e || !e->pending) {
+		DSR_WRITE_UNLOCK(&ack_tbl.lock);
+		return 0;
+	}
+	id = e->id;
+	bitmap = e->bitmap;
+	e->pending = 0;
+
+	DSR_WRITE_UNLOCK(&ack_tbl.lock);
+
+	len = bitmap ? DSR_SACK_HDR_LEN : DSR_ACK_HDR_LEN;
+
+	buf = dsr_pkt_opts_insert(dp, dp->dh.tail, len);
+
+	if (!buf) {
+		DEBUG("Could not piggyback ACK, sending it separately\n");
+
+		if (bitmap)
+			return dsr_sack_send(dp->nxt_hop, id, bitmap);
+
+		return dsr_ack_send(dp->nxt_hop, id);
+	}
+	myaddr = my_addr();
+
+	if (bitmap)
+		dsr_sack_opt_add(buf, len, myaddr, dp->nxt_hop, id, bitmap);
+	else
+		dsr_ack_opt_add(buf, len, myaddr, dp->nxt_hop, id);
+
+	dp->dh.opth->p_len = htons(ntohs(dp->dh.opth->p_len) + len);
+#ifdef __KERNEL__
+	dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+		     ntohs(dp->nh.iph->tot_len) + len, IPPROTO_DSR,
+		     dp->nh.iph->ttl);
+#endif
+	DEBUG("Piggybacked ACK to %s id=%u bitmap=0x%x\n",
+	      print_ip(dp->nxt_hop), id, bitmap);
+
+	return 1;
+}
+
+/* Remove the ACK options of a received packet once they have been processed,
+ * so that a piggybacked ACK is not carried on to the next hop. */
+int dsr_ack_opts_strip(struct dsr_pkt *dp)
+{
+	int len = 0;
+
+	while (dp->num_ack_opts) {
+		struct dsr_ack_opt *ack = dp->ack_opt[--dp->num_ack_opts];
+		int l = ack->length + 2;
+
+		dp->ack_opt[dp->num_ack_opts] = NULL;
+
+		if (dsr_pkt_opts_resize(dp, (char *)ack, l, 0) < 0)
+			return -1;
+		len += l;
+	}
+	if (!len)
+		return 0;
+
+	dp->dh.opth->p_len = htons(ntohs(dp->dh.opth->p_len) - len);
+#ifdef __KERNEL__
+	dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+		     ntohs(dp->nh.iph->tot_len) - len, IPPROTO_DSR,
+		     dp->nh.iph->ttl);
+#endif
+	return len;
+}
+
+int __init NSCLASS dsr_ack_init(void)
+{
+	INIT_TBL(&ack_tbl, ACK_TBL_MAX_LEN);
+
+	init_timer(&ack_tbl_timer);
+
+	ack_tbl_timer.function = &NSCLASS ack_tbl_timeout;
+	ack_tbl_timer.data = 0;
+
+	return 0;
+}
+
+void __exit NSCLASS dsr_ack_cleanup(void)
+{
+	struct ack_entry *e;
+
+	if (timer_pending(&ack_tbl_timer))
+		del_timer_sync(&ack_tbl_timer);
+
+	while ((e = (struct ack_entry *)tbl_detach_first(&ack_tbl)))
+		FREE(e);
+}
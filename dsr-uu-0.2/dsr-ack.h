@@ -25,12 +25,29 @@ struct dsr_ack_opt {
 	u_int32_t src;
 	u_int32_t dst;
 };
+
+/* Selective ACK. Starts like an ACK so that it can be handled as one. */
+struct dsr_sack_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int16_t id;		/* All ids up to this one are acknowledged */
+	u_int32_t src;
+	u_int32_t dst;
+	u_int32_t bitmap;	/* Bit n > 0 set if id + n was also received */
+};
+
 #define DSR_ACK_REQ_HDR_LEN sizeof(struct dsr_ack_req_opt)
 #define DSR_ACK_REQ_OPT_LEN (DSR_ACK_REQ_HDR_LEN - 2)
 #define DSR_ACK_HDR_LEN sizeof(struct dsr_ack_opt)
 #define DSR_ACK_OPT_LEN (DSR_ACK_HDR_LEN - 2)
+#define DSR_SACK_HDR_LEN sizeof(struct dsr_sack_opt)
+#define DSR_SACK_OPT_LEN (DSR_SACK_HDR_LEN - 2)
+#define DSR_SACK_BITS 32
+
+#define ACK_TBL_MAX_LEN 64
 
 int dsr_ack_add_ack_req(struct in_addr neigh);
+int dsr_ack_opts_strip(struct dsr_pkt *dp);
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
@@ -41,6 +58,14 @@ int dsr_ack_req_opt_recv(struct dsr_pkt *dp, struct dsr_ack_req_opt *areq);
 int dsr_ack_opt_recv(struct dsr_ack_opt *ack);
 int dsr_ack_req_send(struct in_addr neigh_addr, unsigned short id);
 int dsr_ack_send(struct in_addr dst, unsigned short id);
+int dsr_sack_send(struct in_addr dst, unsigned short id, u_int32_t bitmap);
+int __dsr_ack_send(struct in_addr dst, unsigned short id, u_int32_t bitmap,
+		   int type);
+int ack_tbl_add_id(struct in_addr neigh, unsigned short id);
+int dsr_ack_piggyback(struct dsr_pkt *dp);
+void ack_tbl_timeout(unsigned long data);
+int dsr_ack_init(void);
+void dsr_ack_cleanup(void);
 
 #endif				/* NO_DECLS */
 
@@ -15,6 +15,7 @@
 #include <linux/init.h>
 #include <linux/if_ether.h>
 #include <net/ip.h>
+#include <net/dst.h>
 #include <linux/random.h>
 #include <linux/wireless.h>
 
@@ -43,6 +44,18 @@ struct dsr_node *dsr_node;
 static int rp_filter = 0;
 static int forwarding = 0;
 
+/* Link layer transmit failures reported by the slave device. They are
+ * handled in a tasklet, since the driver may report them with its own
+ * locks held or from interrupt context. */
+#define LL_TX_FAILED_MAX 16
+
+static unsigned char ll_tx_failed[LL_TX_FAILED_MAX][ETH_ALEN];
+static int ll_tx_failed_len = 0;
+static spinlock_t ll_tx_failed_lock = SPIN_LOCK_UNLOCKED;
+
+static void dsr_ll_tx_failed_task(unsigned long data);
+static DECLARE_TASKLET(ll_tx_failed_tasklet, dsr_ll_tx_failed_task, 0);
+
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,14)
 static int dsr_dev_llrecv(struct sk_buff *skb, struct net_device *indev,
@@ -58,6 +71,102 @@ static struct packet_type dsr_packet_type = {
 	.func = dsr_dev_llrecv,
 };
 
+#ifdef KERNEL26
+#define DSR_LL_RESERVE(dev) LL_RESERVED_SPACE(dev)
+#else
+#define DSR_LL_RESERVE(dev) (((dev)->hard_header_len + 15) & ~15)
+#endif
+
+/* Like skb_cow(), but only unshares the skb if the header area is shared.
+ * Clones that only reference the payload (see dsr_pkt_clone()) do not force a
+ * copy. */
+static inline int dsr_skb_cow_head(struct sk_buff *skb, unsigned int headroom)
+{
+	int delta = headroom - skb_headroom(skb);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
+	int cloned = skb_header_cloned(skb);
+#else
+	int cloned = skb_cloned(skb);
+#endif
+	if (delta < 0)
+		delta = 0;
+
+	if (delta || cloned)
+		return pskb_expand_head(skb, (delta + 15) & ~15, 0, GFP_ATOMIC);
+
+	return 0;
+}
+
+/* Reuse the skb the packet came in by pulling off the old headers and pushing
+ * the new IP header and DSR options in front of the payload, which stays where
+ * it is. Returns NULL if the skb cannot be reused, in which case the caller
+ * has to copy. */
+static struct sk_buff *dsr_skb_reuse(struct dsr_pkt *dp, struct net_device *dev)
+{
+	struct sk_buff *skb = dp->skb;
+	char *buf;
+	int ip_len;
+	int dsr_opts_len = dsr_pkt_opts_len(dp);
+
+	if (!skb || skb_shared(skb) || skb_is_nonlinear(skb))
+		return NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
+	/* Payload only reference, the header area belongs to someone else */
+	if (skb->nohdr)
+		return NULL;
+#endif
+
+	if (!dp->payload || dp->payload < (char *)skb->data ||
+	    dp->payload + dp->payload_len > (char *)skb->tail)
+		return NULL;
+
+	ip_len = dp->nh.iph->ihl << 2;
+
+	/* The IP header may be in the part of the skb that is about to be
+	 * overwritten */
+	if (dp->nh.raw != dp->ip_data) {
+		memcpy(dp->ip_data, dp->nh.raw, ip_len);
+		dp->nh.raw = dp->ip_data;
+	}
+
+	skb_pull(skb, dp->payload - (char *)skb->data);
+	skb_trim(skb, dp->payload_len);
+
+	/* Make sure the header is private and that there is enough headroom
+	 * for the new headers */
+	if (dsr_skb_cow_head(skb, ip_len + dsr_opts_len + DSR_LL_RESERVE(dev)))
+		return NULL;
+
+	dp->payload = (char *)skb->data;
+
+	buf = (char *)skb_push(skb, ip_len + dsr_opts_len);
+
+	memcpy(buf, dp->nh.raw, ip_len);
+
+	ip_send_check((struct iphdr *)buf);
+
+	if (dsr_opts_len)
+		memcpy(buf + ip_len, dp->dh.raw, dsr_opts_len);
+
+	skb->nh.raw = skb->data;
+	skb->mac.raw = skb->data - 14;
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+	skb->ip_summed = CHECKSUM_NONE;
+	memset(skb->cb, 0, sizeof(skb->cb));
+
+	dst_release(skb->dst);
+	skb->dst = NULL;
+#ifdef CONFIG_NETFILTER
+	nf_conntrack_put(skb->nfct);
+	skb->nfct = NULL;
+#endif
+	/* The skb is no longer owned by the packet */
+	dp->skb = NULL;
+
+	return skb;
+}
+
 //skb   --- socket buffer
 struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 {
@@ -67,28 +176,27 @@ struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 	int tot_len;
 	int dsr_opts_len = dsr_pkt_opts_len(dp);
 
+	skb = dsr_skb_reuse(dp, dev);
+
+	if (skb)
+		return skb;
+
 	ip_len = dp->nh.iph->ihl << 2;
 
 	tot_len = ip_len + dsr_opts_len + dp->payload_len;
 
 	DEBUG("ip_len=%d dsr_opts_len=%d payload_len=%d tot_len=%d\n",
 	      ip_len, dsr_opts_len, dp->payload_len, tot_len);
-#ifdef KERNEL26
-	skb = alloc_skb(tot_len + LL_RESERVED_SPACE(dev), GFP_ATOMIC);
-#else
-	skb = alloc_skb(dev->hard_header_len + 15 + tot_len, GFP_ATOMIC);
-#endif
+
+	skb = alloc_skb(tot_len + DSR_LL_RESERVE(dev), GFP_ATOMIC);
+
 	if (!skb) {
 		DEBUG("alloc_skb failed\n");
 		return NULL;
 	}
 
 	/* We align to 16 bytes, for ethernet: 2 bytes + 14 bytes header */
-#ifdef KERNEL26
-	skb_reserve(skb, LL_RESERVED_SPACE(dev));
-#else
-	skb_reserve(skb, (dev->hard_header_len + 15) & ~15);
-#endif
+	skb_reserve(skb, DSR_LL_RESERVE(dev));
 	skb->mac.raw = skb->data - 14;
 	skb->nh.raw = skb->data;
 	skb->dev = dev;
@@ -125,26 +233,41 @@ int dsr_hw_header_create(struct dsr_pkt *dp, struct sk_buff *skb)
 	struct sockaddr broadcast =
 	    { AF_UNSPEC, {0xff, 0xff, 0xff, 0xff, 0xff, 0xff} }; // 㲥
 	struct neighbor_info neigh_info;
+	int len;
 
 	if (dp->dst.s_addr == DSR_BROADCAST)
 		memcpy(neigh_info.hw_addr.sa_data, broadcast.sa_data, ETH_ALEN);
 	else {
 		/* Get hardware destination address */
-		if (neigh_tbl_query(dp->nxt_hop, &neigh_info) < 0) {
+		if (!neigh_tbl_query(dp->nxt_hop, &neigh_info)) {
 			DEBUG
 			    ("Could not get hardware address for next hop %s\n",
 			     print_ip(dp->nxt_hop));
 			return -1;
 		}
+
+		/* Use the header cached for the neighbor if there is one */
+		if (neigh_info.hh_len &&
+		    neigh_info.hh_ifindex == skb->dev->ifindex &&
+		    skb_headroom(skb) >= neigh_info.hh_len) {
+			memcpy(skb_push(skb, neigh_info.hh_len), neigh_info.hh,
+			       neigh_info.hh_len);
+			return 0;
+		}
 	}
 
-	if (skb->dev->hard_header) {
-		skb->dev->hard_header(skb, skb->dev, ETH_P_IP,
-				      neigh_info.hw_addr.sa_data, 0, skb->len);
-	} else {
+	if (!skb->dev->hard_header) {
 		DEBUG("Missing hard_header\n");
 		return -1;
 	}
+
+	len = skb->dev->hard_header(skb, skb->dev, ETH_P_IP,
+				    neigh_info.hw_addr.sa_data, 0, skb->len);
+
+	if (len > 0 && dp->dst.s_addr != DSR_BROADCAST)
+		neigh_tbl_set_hh(dp->nxt_hop, skb->data, len,
+				 skb->dev->ifindex);
+
 	return 0;
 }
 
@@ -496,6 +619,9 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	if (dp->flags & PKT_REQUEST_ACK)
 		maint_buf_add(dp);
 
+	/* After buffering, so that retransmissions do not repeat the ACK */
+	dsr_ack_piggyback(dp);
+
 	dsr_node_lock(dsr_node);
 
 	if (dsr_node->slave_dev)
@@ -545,6 +671,59 @@ out_err:
 	return res;
 }
 
+static void dsr_ll_tx_failed_task(unsigned long data)
+{
+	unsigned char hw_addr[LL_TX_FAILED_MAX][ETH_ALEN];
+	unsigned long flags;
+	int i, n;
+
+	spin_lock_irqsave(&ll_tx_failed_lock, flags);
+	n = ll_tx_failed_len;
+	memcpy(hw_addr, ll_tx_failed, n * ETH_ALEN);
+	ll_tx_failed_len = 0;
+	spin_unlock_irqrestore(&ll_tx_failed_lock, flags);
+
+	for (i = 0; i < n; i++) {
+		struct in_addr nxt_hop;
+
+		if (!neigh_tbl_hw_lookup(hw_addr[i], &nxt_hop)) {
+			DEBUG("No neighbor with hw addr %s\n",
+			      print_eth((char *)hw_addr[i]));
+			continue;
+		}
+		maint_buf_link_failed(nxt_hop);
+	}
+}
+
+/* To be called by the slave device driver when the MAC gives up on a
+ * unicast frame to hw_addr, e.g., from its TX status handler. Only used
+ * when UseLinkLayerFeedback is set. */
+void dsr_ll_tx_failed(unsigned char *hw_addr)
+{
+	unsigned long flags;
+	int i;
+
+	if (!ConfVal(UseLinkLayerFeedback))
+		return;
+
+	spin_lock_irqsave(&ll_tx_failed_lock, flags);
+
+	/* One report per neighbor is enough */
+	for (i = 0; i < ll_tx_failed_len; i++)
+		if (memcmp(ll_tx_failed[i], hw_addr, ETH_ALEN) == 0)
+			break;
+
+	if (i == ll_tx_failed_len && i < LL_TX_FAILED_MAX) {
+		memcpy(ll_tx_failed[i], hw_addr, ETH_ALEN);
+		ll_tx_failed_len++;
+	}
+	spin_unlock_irqrestore(&ll_tx_failed_lock, flags);
+
+	tasklet_schedule(&ll_tx_failed_tasklet);
+}
+
+EXPORT_SYMBOL(dsr_ll_tx_failed);
+
 /* Main receive function for packets originated in user space */
 static int dsr_dev_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
@@ -684,6 +863,7 @@ dev_ok:
 
 void __exit dsr_dev_cleanup(void)
 {
+	tasklet_kill(&ll_tx_failed_tasklet);
 
 	unregister_netdevice_notifier(&netdev_notifier);
 	unregister_inetaddr_notifier(&inetaddr_notifier);
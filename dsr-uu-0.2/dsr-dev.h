@@ -18,6 +18,7 @@
 
 int dsr_dev_xmit(struct dsr_pkt *dp);
 int dsr_dev_deliver(struct dsr_pkt *dp);
+void dsr_ll_tx_failed(unsigned char *hw_addr);
 
 int __init dsr_dev_init(char *ifname);
 void __exit dsr_dev_cleanup(void);
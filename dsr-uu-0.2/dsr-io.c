@@ -33,12 +33,20 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 	int i = 0, action;
 	int mask = DSR_PKT_NONE;
 
+	/* Relayed packets with only a source route skip option processing */
+	if (dsr_srt_opt_fwd(dp) == DSR_PKT_FORWARD)
+		goto forward;
+
 	/* Process DSR Options */
 	action = dsr_opt_recv(dp);
 
 	/* Add mac address of previous hop to the neighbor table */
 
 	if (dp->flags & PKT_PROMISC_RECV) {
+		/* An overheard forward may acknowledge a packet we sent */
+		if (ConfVal(TryPassiveAcks))
+			maint_buf_passive_ack(dp);
+
 		dsr_pkt_free(dp);
 		return 0;
 	}
@@ -62,26 +70,9 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 			//dsr_opt_remove(dp);
 			break;
 		case DSR_PKT_FORWARD:
-
-#ifdef NS2
-			if (dp->nh.iph->ttl() < 1)
-#else
-			if (dp->nh.iph->ttl < 1)
-#endif
-			{
-				DEBUG("ttl=0, dropping!\n");
-				dsr_pkt_free(dp);
-				return 0;
-			} else {
-				DEBUG("Forwarding %s %s nh %s\n",
-				      print_ip(dp->src),
-				      print_ip(dp->dst), print_ip(dp->nxt_hop));
-				XMIT(dp);
-				return 0;
-			}
-			break;
+			goto forward;
 		case DSR_PKT_FORWARD_RREQ:
-			XMIT(dp);
+			dsr_rreq_fwd(dp);
 			return 0;
 		case DSR_PKT_SEND_RREP:
 			/* In dsr-rrep.c */
@@ -115,6 +106,21 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 
 	dsr_pkt_free(dp);
 
+	return 0;
+ forward:
+#ifdef NS2
+	if (dp->nh.iph->ttl() < 1)
+#else
+	if (dp->nh.iph->ttl < 1)
+#endif
+	{
+		DEBUG("ttl=0, dropping!\n");
+		dsr_pkt_free(dp);
+		return 0;
+	}
+	DEBUG("Forwarding %s %s nh %s\n",
+	      print_ip(dp->src), print_ip(dp->dst), print_ip(dp->nxt_hop));
+	XMIT(dp);
 	return 0;
 }
 
@@ -127,20 +133,17 @@ void NSCLASS dsr_start_xmit(struct dsr_pkt *dp)
 		return;
 	}
 
-	dp->srt = dsr_rtc_find(dp->src, dp->dst);
+	res = dsr_srt_tmpl_add(dp);
 
-	if (dp->srt) {
-
-		if (dsr_srt_add(dp) < 0) {
-			DEBUG("Could not add source route\n");
-			goto out;
-		}
+	if (res == 0) {
 		/* Send packet */
-
 		XMIT(dp);
 
 		return;
 
+	} else if (res != -EHOSTUNREACH) {
+		DEBUG("Could not add source route\n");
+		goto out;
 	} else {
 #ifdef NS2
 		res = send_buf_enqueue_packet(dp, &DSRUU::ns_xmit);
@@ -27,6 +27,7 @@
 #endif
 #include <net/icmp.h>
 #include <linux/ctype.h>
+#include <linux/inet.h>
 
 #include "dsr.h"
 #include "dsr-dev.h"
@@ -36,6 +37,8 @@
 #include "neigh.h"
 #include "dsr-rreq.h"
 #include "dsr-rrep.h"
+#include "dsr-ack.h"
+#include "dsr-probe.h"
 #include "maint-buf.h"
 #include "send-buf.h"
 #include "link-cache.h"
@@ -215,6 +218,21 @@ static int dsr_config_proc_write(struct file *file, const char *buffer,
 			if (confvals_def[i].type == COMMAND) {
 				if (i == FlushLinkCache)
 					lc_flush();
+
+				/* Stand-in for a link layer failure report,
+				 * e.g., "LinkTxFailed=10.0.0.2" */
+				if (i == LinkTxFailed &&
+				    ConfVal(UseLinkLayerFeedback)) {
+					struct in_addr nxt_hop;
+
+					from = strstr(cmd, "=");
+
+					if (!from)
+						break;
+
+					nxt_hop.s_addr = in_aton(from + 1);
+					maint_buf_link_failed(nxt_hop);
+				}
 				break;
 			}
 
@@ -255,6 +273,12 @@ static int dsr_config_proc_write(struct file *file, const char *buffer,
 			if (i == SendBufferSize)
 				send_buf_set_max_len(val);
 
+			if (i == NeighborTableSize)
+				neigh_tbl_set_max_len(val);
+
+			if (i == ProbeInterval)
+				dsr_probe_start();
+
 			DEBUG("Setting %s to %d\n", confvals_def[i].name, val);
 		}
 	}
@@ -354,11 +378,19 @@ static int __init dsr_module_init(void)  //dsr ģ
 	dbg_init();
 #endif
 	parse_mackill();
-	
+
+	res = dsr_pkt_cache_init();
+
+	if (res < 0) {
+		DEBUG("dsr_pkt cache init failed\n");
+		return res;
+	}
+
 	res = dsr_dev_init(ifname);
 
 	if (res < 0) {
 		DEBUG("dsr-dev init failed\n");
+		dsr_pkt_cache_cleanup();
 		return -EAGAIN;
 	}
 
@@ -397,10 +429,20 @@ static int __init dsr_module_init(void)  //dsr ģ
 	if (res < 0)
 		goto cleanup_nf_hook1;
 
+	res = dsr_ack_init();
+
+	if (res < 0)
+		goto cleanup_maint_buf;
+
+	res = dsr_probe_init();
+
+	if (res < 0)
+		goto cleanup_ack;
+
 	proc = create_proc_entry(CONFIG_PROC_NAME, S_IRUGO | S_IWUSR, proc_net);
 
 	if (!proc)
-		goto cleanup_maint_buf;
+		goto cleanup_probe;
 
 	proc->owner = THIS_MODULE;
 	proc->read_proc = dsr_config_proc_read;
@@ -425,6 +467,10 @@ cleanup_proc:
 	proc_net_remove(CONFIG_PROC_NAME);
 #endif
 
+cleanup_probe:
+	dsr_probe_cleanup();
+cleanup_ack:
+	dsr_ack_cleanup();
 cleanup_maint_buf:
 	maint_buf_cleanup();
 cleanup_nf_hook1:
@@ -441,6 +487,7 @@ cleanup_send_buf:
 	send_buf_cleanup();
 cleanup_dsr_dev:
 	dsr_dev_cleanup();
+	dsr_pkt_cache_cleanup();
 #ifdef DEBUG
 	dbg_cleanup();
 #endif
@@ -461,8 +508,11 @@ static void __exit dsr_module_cleanup(void)
 	rreq_tbl_cleanup();
 	grat_rrep_tbl_cleanup();
 	neigh_tbl_cleanup();
+	dsr_probe_cleanup();
 	maint_buf_cleanup();
+	dsr_ack_cleanup();
 	send_buf_cleanup();
+	dsr_pkt_cache_cleanup();
 #ifdef DEBUG
 	dbg_cleanup();
 #endif
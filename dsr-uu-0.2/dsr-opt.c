@@ -47,10 +47,13 @@ struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 {
 	struct iphdr *iph;
 
-	dp->nh.iph = iph = (struct iphdr *)dp->ip_data;
+	iph = (struct iphdr *)dp->ip_data;
 	
 	if (dp->skb && dp->skb->nh.raw) {
-		memcpy(dp->ip_data, dp->skb->nh.raw, ip_len);
+		/* Keep the header if we already have a private copy, the one
+		 * in the skb may be gone */
+		if (dp->nh.raw != dp->ip_data)
+			memcpy(dp->ip_data, dp->skb->nh.raw, ip_len);
 	} else {
 		iph->version = IPVERSION;
 		iph->ihl = 5;
@@ -61,6 +64,7 @@ struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 		iph->saddr = src.s_addr;
 		iph->daddr = dst.s_addr;
 	}
+	dp->nh.iph = iph;
 	
 	iph->tot_len = htons(tot_len);
 	iph->protocol = protocol;
@@ -115,34 +119,104 @@ int NSCLASS dsr_opt_remove(struct dsr_pkt *dp) //删除DSR中的选项
 	return len;
 }
 
+/* Valid lengths of the options we know about. The length field must be at
+ * least min_len and, if stride is set, grow in units of stride. */
+static const struct dsr_opt_info {
+	u_int8_t type;
+	u_int8_t min_len;
+	u_int8_t stride;
+} dsr_opt_tbl[] = {
+	{ DSR_OPT_PADN, 0, 0 },
+	{ DSR_OPT_RREP, 1 + sizeof(struct in_addr), sizeof(struct in_addr) },
+	{ DSR_OPT_RREQ, DSR_RREQ_OPT_LEN, sizeof(struct in_addr) },
+	{ DSR_OPT_RERR, DSR_RERR_OPT_LEN, 0 },
+	{ DSR_OPT_PREV_HOP, sizeof(struct in_addr), 0 },
+	{ DSR_OPT_PROBE, DSR_PROBE_OPT_LEN(0), sizeof(struct dsr_probe_lq) },
+	{ DSR_OPT_ACK, DSR_ACK_OPT_LEN, 0 },
+	{ DSR_OPT_SACK, DSR_SACK_OPT_LEN, 0 },
+	{ DSR_OPT_SRT, DSR_SRT_HDR_LEN - 2, sizeof(struct in_addr) },
+	{ DSR_OPT_TIMEOUT, 2, 0 },
+	{ DSR_OPT_FLOWID, 2, 0 },
+	{ DSR_OPT_ACK_REQ, DSR_ACK_REQ_OPT_LEN, 0 },
+};
+
+#define DSR_OPT_TBL_LEN (sizeof(dsr_opt_tbl) / sizeof(struct dsr_opt_info))
+
+static inline const struct dsr_opt_info *dsr_opt_info_get(int type)
+{
+	unsigned int i;
+
+	for (i = 0; i < DSR_OPT_TBL_LEN; i++)
+		if (dsr_opt_tbl[i].type == type)
+			return &dsr_opt_tbl[i];
+	return NULL;
+}
+
+/* Walk the options once, check that every option fits within the options
+ * header and has a valid length, and record where the options are so that
+ * they can be processed without walking the packet again. Returns the number
+ * of options or -1 if the packet is malformed. */
 int dsr_opt_parse(struct dsr_pkt *dp)  //解析DSR包，判断是否有错误信息
 {
-	int dsr_len, l, n = 0;
+	const struct dsr_opt_info *info;
 	struct dsr_opt *dopt;
+	int dsr_len, l, n = 0;
 
 	if (!dp)
 		return -1;
 
 	dsr_len = dsr_pkt_opts_len(dp);
 
-	l = DSR_OPT_HDR_LEN;
-	dopt = DSR_GET_OPT(dp->dh.opth);
+	if (dsr_len < (int)DSR_OPT_HDR_LEN ||
+	    ntohs(dp->dh.opth->p_len) + (int)DSR_OPT_HDR_LEN != dsr_len) {
+#ifndef NS2
+		DEBUG("Bad DSR options length %d\n", dsr_len);
+#endif
+		return -1;
+	}
 	
 	dp->num_rrep_opts = dp->num_rerr_opts = dp->num_rreq_opts = dp->num_ack_opts = 0;
 	
 	dp->srt_opt = NULL;
 	dp->ack_req_opt = NULL;
+	dp->probe_opt = NULL;
+
+	l = DSR_OPT_HDR_LEN;
+
+	while (l < dsr_len) {
+		dopt = (struct dsr_opt *)(dp->dh.raw + l);
+
+		if (dopt->type == DSR_OPT_PAD1) {
+			l++;
+			continue;
+		}
+		
+		if (dsr_len - l < 2 || l + dopt->length + 2 > dsr_len) {
+#ifndef NS2
+			DEBUG("Truncated DSR option type=%d\n", dopt->type);
+#endif
+			return -1;
+		}
+
+		info = dsr_opt_info_get(dopt->type);
+
+		if (info && (dopt->length < info->min_len ||
+			     (info->stride && 
+			      (dopt->length - info->min_len) % info->stride))) {
+#ifndef NS2
+			DEBUG("Bad length %d of DSR option type=%d\n",
+			      dopt->length, dopt->type);
+#endif
+			return -1;
+		}
 
-	while (l < dsr_len && (dsr_len - l) > 2) {
 		switch (dopt->type) {
-		case DSR_OPT_PADN:  //选项为
-			break;
 		case DSR_OPT_RREQ: /*选项为路由请求*/
-			if (dp->num_rreq_opts == 0)
-				dp->rreq_opt = (struct dsr_rreq_opt *)dopt;
+			if (dp->num_rreq_opts < MAX_RREQ_OPTS)
+				dp->rreq_opt[dp->num_rreq_opts++] = (struct dsr_rreq_opt *)dopt;
 #ifndef NS2
 			else
-				DEBUG("ERROR: More than one RREQ option!!\n");
+				DEBUG("Maximum RREQ opts in one packet reached\n");
 #endif
 			break;
 		case DSR_OPT_RREP: //选项为路由回复
@@ -161,9 +235,8 @@ int dsr_opt_parse(struct dsr_pkt *dp)  //解析DSR包，判断是否有错误信
 				DEBUG("Maximum RERR opts in one packet reached\n");
 #endif
 			break;
-		case DSR_OPT_PREV_HOP: //选项为前一跳
-			break;
 		case DSR_OPT_ACK:  //选项为ack
+		case DSR_OPT_SACK:
 			if (dp->num_ack_opts < MAX_ACK_OPTS)
 				dp->ack_opt[dp->num_ack_opts++] = (struct dsr_ack_opt *)dopt;
 #ifndef NS2
@@ -179,10 +252,6 @@ int dsr_opt_parse(struct dsr_pkt *dp)  //解析DSR包，判断是否有错误信
 				DEBUG("More than one source route in packet\n");
 #endif
 			break;
-		case DSR_OPT_TIMEOUT:  //超时
-			break;
-		case DSR_OPT_FLOWID:  
-			break;
 		case DSR_OPT_ACK_REQ:  //ack请求
 			if (!dp->ack_req_opt)
 				dp->ack_req_opt = (struct dsr_ack_req_opt *)dopt;
@@ -191,28 +260,34 @@ int dsr_opt_parse(struct dsr_pkt *dp)  //解析DSR包，判断是否有错误信
 				DEBUG("More than one ACK REQ in packet\n");
 #endif
 			break;
-		case DSR_OPT_PAD1:
-			l++;
-			dopt++;
-			continue;
-#ifndef NS2
+		case DSR_OPT_PROBE:
+			if (!dp->probe_opt)
+				dp->probe_opt = (struct dsr_probe_opt *)dopt;
+			break;
+		case DSR_OPT_PADN:
+		case DSR_OPT_PREV_HOP:
+		case DSR_OPT_TIMEOUT:
+		case DSR_OPT_FLOWID:
+			break;
 		default:
+#ifndef NS2
 			DEBUG("Unknown DSR option type=%d\n", dopt->type);
 #endif
 		}
 		l += dopt->length + 2;
-		dopt = DSR_GET_NEXT_OPT(dopt);
 		n++;
 	}
 	
 	return n;
 }
 
+/* Process the options recorded by dsr_opt_parse(). They are handled in the
+ * order we put them in packets ourselves, i.e., the source route first so
+ * that the previous hop is known when an ACK REQ is processed. */
 int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)  //收到一个含option的dsr包
 {
-	int dsr_len, l;
 	int action = 0;
-	struct dsr_opt *dopt;
+	int i;
 	struct in_addr myaddr;
 
 	if (!dp)
@@ -231,74 +306,34 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)  //收到一个含option的dsr包
 	if (dp->dst.s_addr == myaddr.s_addr && dp->payload_len != 0)
 		action |= DSR_PKT_DELIVER; //向上层递交
 #endif
-	dsr_len = dsr_pkt_opts_len(dp);
+	if (dp->srt_opt)
+		action |= dsr_srt_opt_recv(dp, dp->srt_opt);
 
-	l = DSR_OPT_HDR_LEN;
-	dopt = DSR_GET_OPT(dp->dh.opth);
+	/* Only the source route is of interest in overheard packets */
+	if (dp->flags & PKT_PROMISC_RECV)
+		return action;
 
-	//DEBUG("Parsing DSR packet l=%d dsr_len=%d\n", l, dsr_len);
+	if (dp->probe_opt)
+		action |= dsr_probe_opt_recv(dp, dp->probe_opt);
 
-	while (l < dsr_len && (dsr_len - l) > 2) {
-		//DEBUG("dsr_len=%d l=%d\n", dsr_len, l);
-		switch (dopt->type) {
-		case DSR_OPT_PADN:
-			break;
-		case DSR_OPT_RREQ: //如果是收到一个RREQ包
-			if (dp->flags & PKT_PROMISC_RECV)
-				break;
-			
-			action |= dsr_rreq_opt_recv(dp, (struct dsr_rreq_opt *)dopt); //action 与dsr_rreq_opt_recv(,)按位或运算后赋值给action
-			break;
-		case DSR_OPT_RREP: //如果是收到一个RREP包
-			if (dp->flags & PKT_PROMISC_RECV)
-				break;
-			
-			action |= dsr_rrep_opt_recv(dp, (struct dsr_rrep_opt *)dopt);  //同上       
-			break;
-		case DSR_OPT_RERR:  //如果收到的是RERR包
-			if (dp->flags & PKT_PROMISC_RECV)
-				break;
-			if (dp->num_rerr_opts < MAX_RERR_OPTS) {
-				action |=
-				    dsr_rerr_opt_recv(dp, (struct dsr_rerr_opt *)dopt);  //同上
-			}
+	if (dp->num_rreq_opts)
+		action |= dsr_rreq_opts_recv(dp);
+
+	for (i = 0; i < dp->num_rrep_opts; i++)
+		action |= dsr_rrep_opt_recv(dp, dp->rrep_opt[i]);
+
+	for (i = 0; i < dp->num_rerr_opts; i++)
+		action |= dsr_rerr_opt_recv(dp, dp->rerr_opt[i]);
+
+	for (i = 0; i < dp->num_ack_opts; i++)
+		action |= dsr_ack_opt_recv(dp->ack_opt[i]);
+
+	/* ACKs may be piggybacked on packets that are forwarded */
+	if (dp->num_ack_opts && dsr_ack_opts_strip(dp) < 0)
+		action |= DSR_PKT_ERROR;
+
+	if (dp->ack_req_opt)
+		action |= dsr_ack_req_opt_recv(dp, dp->ack_req_opt);
 
-			break;
-		case DSR_OPT_PREV_HOP:  //
-			break;
-		case DSR_OPT_ACK:
-			if (dp->flags & PKT_PROMISC_RECV)
-				break;
-
-			if (dp->num_ack_opts < MAX_ACK_OPTS) {
-				dp->ack_opt[dp->num_ack_opts++] =
-				    (struct dsr_ack_opt *)dopt;
-				action |=
-				    dsr_ack_opt_recv((struct dsr_ack_opt *)
-						     dopt);
-			}
-			break;
-		case DSR_OPT_SRT:
-			action |= dsr_srt_opt_recv(dp, (struct dsr_srt_opt *)dopt);
-			break;
-		case DSR_OPT_TIMEOUT:
-			break;
-		case DSR_OPT_FLOWID:
-			break;
-		case DSR_OPT_ACK_REQ:
-			action |=
-			    dsr_ack_req_opt_recv(dp, (struct dsr_ack_req_opt *)
-						 dopt);
-			break;
-		case DSR_OPT_PAD1:
-			l++;
-			dopt++;
-			continue;
-		default:
-			DEBUG("Unknown DSR option type=%d\n", dopt->type);
-		}
-		l += dopt->length + 2;
-		dopt = DSR_GET_NEXT_OPT(dopt);
-	}
 	return action;
 }
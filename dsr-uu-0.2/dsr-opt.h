@@ -77,7 +77,9 @@ struct dsr_pad1_opt {
 #define DSR_OPT_RREQ       2
 #define DSR_OPT_RERR       3
 #define DSR_OPT_PREV_HOP   5
+#define DSR_OPT_PROBE      7	/* Not in the draft */
 #define DSR_OPT_ACK       32
+#define DSR_OPT_SACK      33	/* Not in the draft */
 #define DSR_OPT_SRT       96
 #define DSR_OPT_TIMEOUT  128
 #define DSR_OPT_FLOWID   129
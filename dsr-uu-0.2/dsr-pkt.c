@@ -5,9 +5,11 @@
  *
  * Author: Erik Nordström, <erikn@it.uu.se>
  */
-#ifdef __KERNEL_
+#ifdef __KERNEL__
+#include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/if_ether.h>
+#include <linux/slab.h>
 #endif
 
 #ifdef NS2
@@ -16,49 +18,255 @@
 
 #include "debug.h"
 #include "dsr-opt.h"
+#include "dsr-ack.h"
 #include "dsr.h"
 
-char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len)
+/* Received options may grow by one address (forwarded RREQ) and an ACK REQ
+ * option before being sent on */
+#define DSR_RECV_OPTS_RESERVE (sizeof(struct in_addr) + DSR_ACK_REQ_HDR_LEN)
+
+/* Packet descriptors are allocated for every packet sent or received, so they
+ * are recycled rather than handed back to the general allocator. In the kernel
+ * a slab cache is used (which keeps per-CPU object arrays), in the simulator a
+ * simple free list. */
+#ifdef __KERNEL__
+static kmem_cache_t *dsr_pkt_cache = NULL;
+#else
+static struct dsr_pkt *dsr_pkt_free_list = NULL;
+static int dsr_pkt_free_list_len = 0;
+#endif
+
+#define DSR_PKT_FREE_LIST_MAX 256
+
+static inline struct dsr_pkt *dsr_pkt_get(void)
 {
+	struct dsr_pkt *dp;
+#ifdef __KERNEL__
+	dp = (struct dsr_pkt *)kmem_cache_alloc(dsr_pkt_cache, GFP_ATOMIC);
+#else
+	dp = dsr_pkt_free_list;
+
+	if (dp) {
+		dsr_pkt_free_list = *(struct dsr_pkt **)dp;
+		dsr_pkt_free_list_len--;
+	} else
+		dp = (struct dsr_pkt *)MALLOC(sizeof(struct dsr_pkt),
+					      GFP_ATOMIC);
+#endif
 	if (!dp)
 		return NULL;
 
-	dp->dh.raw = (char *)MALLOC(len + DEFAULT_TAILROOM, GFP_ATOMIC);
+	/* Only the header fields are cleared. The option pointer arrays are
+	 * only valid up to their num_*_opts counters, so they are left as
+	 * they are. */
+	dp->src.s_addr = dp->dst.s_addr = 0;
+	dp->nxt_hop.s_addr = dp->prv_hop.s_addr = 0;
+	dp->flags = 0;
+	dp->salvage = 0;
+	dp->mac.raw = NULL;
+	dp->nh.raw = NULL;
+#ifdef NS2
+	memset(&dp->ip_data, 0, sizeof(dp->ip_data));
+#endif
+	dp->dh.raw = dp->dh.tail = dp->dh.end = NULL;
+	dp->num_rrep_opts = dp->num_rerr_opts = 0;
+	dp->num_rreq_opts = dp->num_ack_opts = 0;
+	dp->srt_opt = NULL;
+	dp->ack_req_opt = NULL;
+	dp->probe_opt = NULL;
+	dp->srt = NULL;
+	dp->payload_len = 0;
+	dp->payload = NULL;
+#ifdef NS2
+	dp->p = NULL;
+#else
+	dp->skb = NULL;
+#endif
+	return dp;
+}
+
+static inline void dsr_pkt_put(struct dsr_pkt *dp)
+{
+#ifdef __KERNEL__
+	kmem_cache_free(dsr_pkt_cache, dp);
+#else
+	if (dsr_pkt_free_list_len >= DSR_PKT_FREE_LIST_MAX) {
+		FREE(dp);
+		return;
+	}
+	*(struct dsr_pkt **)dp = dsr_pkt_free_list;
+	dsr_pkt_free_list = dp;
+	dsr_pkt_free_list_len++;
+#endif
+}
+
+int dsr_pkt_cache_init(void)
+{
+#ifdef __KERNEL__
+	dsr_pkt_cache = kmem_cache_create("dsr_pkt", sizeof(struct dsr_pkt),
+					  0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+	if (!dsr_pkt_cache)
+		return -ENOMEM;
+#endif
+	return 0;
+}
+
+void dsr_pkt_cache_cleanup(void)
+{
+#ifdef __KERNEL__
+	if (dsr_pkt_cache && kmem_cache_destroy(dsr_pkt_cache))
+		DEBUG("dsr_pkt cache not empty on cleanup\n");
+
+	dsr_pkt_cache = NULL;
+#else
+	while (dsr_pkt_free_list) {
+		struct dsr_pkt *dp = dsr_pkt_free_list;
+		dsr_pkt_free_list = *(struct dsr_pkt **)dp;
+		FREE(dp);
+	}
+	dsr_pkt_free_list_len = 0;
+#endif
+}
+
+/* Options space is laid out up front: callers pass the exact length of the
+ * options they are about to write and the tailroom covers only what can be
+ * added to this packet later on its way out. */
+char *dsr_pkt_alloc_opts_reserve(struct dsr_pkt *dp, int len, int reserve)
+{
+	if (!dp)
+		return NULL;
+
+	dp->dh.raw = (char *)MALLOC(len + reserve, GFP_ATOMIC);
 
 	if (!dp->dh.raw)
 		return NULL;
 
 	dp->dh.tail = dp->dh.raw + len;
-	dp->dh.end = dp->dh.tail + DEFAULT_TAILROOM;
+	dp->dh.end = dp->dh.tail + reserve;
 
 	return dp->dh.raw;
 }
 
-char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len)
+/* An ACK REQ option is added by the maintenance buffer to packets that
+ * request acknowledgements. */
+char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len)
 {
-	char *tmp;
-	int old_len;
+	if (!dp)
+		return NULL;
 
-	if (!dp || !dp->dh.raw)
+	return dsr_pkt_alloc_opts_reserve(dp, len, 
+					  (dp->flags & PKT_REQUEST_ACK) ? 
+					  DSR_ACK_REQ_HDR_LEN : 0);
+}
+
+static inline char *dsr_opt_rebase(char *p, char *old, char *raw, char *pos,
+				   int delta)
+{
+	if (!p)
 		return NULL;
+	
+	return raw + (p - old) + (p >= pos ? delta : 0);
+}
 
-	if (dsr_pkt_tailroom(dp) > len) {
-		tmp = dp->dh.tail;
+/* Update the option pointers after the options area has moved from "old" to
+ * dp->dh.raw and everything from "pos" and onwards has moved delta bytes */
+static void dsr_pkt_opts_rebase(struct dsr_pkt *dp, char *old, char *pos,
+				int delta)
+{
+	char *raw = dp->dh.raw;
+	int i;
+
+#define REBASE(p, type) \
+	p = (type)dsr_opt_rebase((char *)p, old, raw, pos, delta)
+
+	REBASE(dp->srt_opt, struct dsr_srt_opt *);
+	REBASE(dp->ack_req_opt, struct dsr_ack_req_opt *);
+	REBASE(dp->probe_opt, struct dsr_probe_opt *);
+
+	for (i = 0; i < dp->num_rreq_opts; i++)
+		REBASE(dp->rreq_opt[i], struct dsr_rreq_opt *);
+	for (i = 0; i < dp->num_rrep_opts; i++)
+		REBASE(dp->rrep_opt[i], struct dsr_rrep_opt *);
+	for (i = 0; i < dp->num_rerr_opts; i++)
+		REBASE(dp->rerr_opt[i], struct dsr_rerr_opt *);
+	for (i = 0; i < dp->num_ack_opts; i++)
+		REBASE(dp->ack_opt[i], struct dsr_ack_opt *);
+#undef REBASE
+}
+
+/* Open a gap of len bytes at pos in the options area. The existing options
+ * are moved in place if there is tailroom, otherwise they are copied once
+ * into a buffer of exactly the new size. Option pointers are updated, but
+ * the DSR options header length is left to the caller. */
+char *dsr_pkt_opts_insert(struct dsr_pkt *dp, char *pos, int len)
+{
+	char *old, *buf;
+	int off, opts_len;
+
+	if (!dp || !dp->dh.raw || len < 0 ||
+	    pos < dp->dh.raw || pos > dp->dh.tail)
+		return NULL;
+
+	old = dp->dh.raw;
+	off = pos - old;
+	opts_len = dsr_pkt_opts_len(dp);
+
+	if (dsr_pkt_tailroom(dp) >= len) {
+		memmove(pos + len, pos, dp->dh.tail - pos);
 		dp->dh.tail += len;
-		return tmp;
+		dsr_pkt_opts_rebase(dp, old, pos, len);
+		return pos;
 	}
 
-	tmp = dp->dh.raw;
-	old_len = dsr_pkt_opts_len(dp);
+	buf = (char *)MALLOC(opts_len + len, GFP_ATOMIC);
 
-	if (!dsr_pkt_alloc_opts(dp, old_len + len))
+	if (!buf)
 		return NULL;
 
-	memcpy(dp->dh.raw, tmp, old_len);
+	memcpy(buf, old, off);
+	memcpy(buf + off + len, pos, opts_len - off);
+
+	dp->dh.raw = buf;
+	dp->dh.tail = dp->dh.end = buf + opts_len + len;
+
+	dsr_pkt_opts_rebase(dp, old, pos, len);
+
+	FREE(old);
+
+	return buf + off;
+}
+
+/* Change the length of the option at opt from old_len to new_len bytes,
+ * moving the options that follow. */
+int dsr_pkt_opts_resize(struct dsr_pkt *dp, char *opt, int old_len,
+			int new_len)
+{
+	char *end;
+	int delta;
+
+	if (!dp || !dp->dh.raw || !opt)
+		return -1;
 
-	FREE(tmp);
+	end = opt + old_len;
+	delta = new_len - old_len;
 
-	return (dp->dh.raw + old_len);
+	if (delta > 0)
+		return dsr_pkt_opts_insert(dp, end, delta) ? 0 : -1;
+
+	if (delta < 0) {
+		memmove(end + delta, end, dp->dh.tail - end);
+		dp->dh.tail += delta;
+		dsr_pkt_opts_rebase(dp, dp->dh.raw, end, delta);
+	}
+	return 0;
+}
+
+char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len)
+{
+	if (!dp || !dp->dh.raw)
+		return NULL;
+
+	return dsr_pkt_opts_insert(dp, dp->dh.tail, len);
 }
 
 int dsr_pkt_free_opts(struct dsr_pkt *dp)
@@ -74,11 +282,10 @@ int dsr_pkt_free_opts(struct dsr_pkt *dp)
 
 	dp->dh.raw = dp->dh.end = dp->dh.tail = NULL;
 	dp->srt_opt = NULL;
-	dp->rreq_opt = NULL;
-	memset(dp->rrep_opt, 0, sizeof(struct dsr_rrep_opt *) * MAX_RREP_OPTS);
-	memset(dp->rerr_opt, 0, sizeof(struct dsr_rerr_opt *) * MAX_RERR_OPTS);
-	memset(dp->ack_opt, 0, sizeof(struct dsr_ack_opt *) * MAX_ACK_OPTS);
-	dp->num_rrep_opts = dp->num_rerr_opts = dp->num_ack_opts = 0;
+	dp->ack_req_opt = NULL;
+	dp->probe_opt = NULL;
+	dp->num_rrep_opts = dp->num_rerr_opts = 0;
+	dp->num_rreq_opts = dp->num_ack_opts = 0;
 
 	return len;
 }
@@ -90,13 +297,11 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p)
 	struct hdr_cmn *cmh;
 	int dsr_opts_len = 0;
 
-	dp = (struct dsr_pkt *)MALLOC(sizeof(struct dsr_pkt), GFP_ATOMIC);
+	dp = dsr_pkt_get();
 
 	if (!dp)
 		return NULL;
 
-	memset(dp, 0, sizeof(struct dsr_pkt));
-
 	if (p) {
 		cmh = hdr_cmn::access(p);
 
@@ -116,14 +321,19 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p)
 
 			dsr_opts_len = ntohs(opth->p_len) + DSR_OPT_HDR_LEN;
 
-			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
-				FREE(dp);
+			if (!dsr_pkt_alloc_opts_reserve(dp, dsr_opts_len,
+							DSR_RECV_OPTS_RESERVE)) {
+				dsr_pkt_put(dp);
 				return NULL;
 			}
 
 			memcpy(dp->dh.raw, (char *)opth, dsr_opts_len);
 
-			dsr_opt_parse(dp);
+			if (dsr_opt_parse(dp) < 0) {
+				dsr_pkt_free_opts(dp);
+				dsr_pkt_put(dp);
+				return NULL;
+			}
 
 			if ((DATA_PACKET(dp->dh.opth->nh) ||
 			    dp->dh.opth->nh == PT_PING) && 
@@ -147,13 +357,11 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 	struct dsr_pkt *dp;
 	int dsr_opts_len = 0;
 
-	dp = (struct dsr_pkt *)MALLOC(sizeof(struct dsr_pkt), GFP_ATOMIC);
+	dp = dsr_pkt_get();
 
 	if (!dp)
 		return NULL;
 
-	memset(dp, 0, sizeof(struct dsr_pkt));
-
 	if (skb) {
 	/* 	skb_unlink(skb); */
 
@@ -172,14 +380,29 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 			opth = (struct dsr_opt_hdr *)(dp->nh.raw + (dp->nh.iph->ihl << 2));
 			dsr_opts_len = ntohs(opth->p_len) + DSR_OPT_HDR_LEN;
 
-			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
-				FREE(dp);
+			if (dsr_opts_len > ntohs(dp->nh.iph->tot_len) -
+			    (dp->nh.iph->ihl << 2)) {
+				DEBUG("DSR options longer than packet\n");
+				dsr_pkt_put(dp);
+				return NULL;
+			}
+
+			if (!dsr_pkt_alloc_opts_reserve(dp, dsr_opts_len,
+							DSR_RECV_OPTS_RESERVE)) {
+				dsr_pkt_put(dp);
 				return NULL;
 			}
 
 			memcpy(dp->dh.raw, (char *)opth, dsr_opts_len);
 			
 			n = dsr_opt_parse(dp);
+
+			if (n < 0) {
+				DEBUG("Malformed DSR options\n");
+				dsr_pkt_free_opts(dp);
+				dsr_pkt_put(dp);
+				return NULL;
+			}
 			
 			DEBUG("Packet has %d DSR option(s)\n", n);
 		}
@@ -198,6 +421,98 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 
 #endif
 
+/* Create a copy of a packet with a private IP header and DSR options, but
+ * which shares the payload with the original. In the kernel the payload is
+ * referenced through a clone of the skb that only covers the payload, so that
+ * the original can still push its headers in place. In ns-2 the Packet is
+ * reference counted and is only copied if the clone has to be sent. */
+struct dsr_pkt *dsr_pkt_clone(struct dsr_pkt *dp)
+{
+	struct dsr_pkt *dp_clone;
+	int dsr_opts_len, i;
+
+	if (!dp)
+		return NULL;
+
+	dp_clone = dsr_pkt_get();
+
+	if (!dp_clone)
+		return NULL;
+
+	dp_clone->src = dp->src;
+	dp_clone->dst = dp->dst;
+	dp_clone->nxt_hop = dp->nxt_hop;
+	dp_clone->prv_hop = dp->prv_hop;
+	dp_clone->flags = dp->flags;
+	dp_clone->salvage = dp->salvage;
+	dp_clone->payload = dp->payload;
+	dp_clone->payload_len = dp->payload_len;
+#ifdef NS2
+	dp_clone->mac.raw = dp->mac.raw;
+	dp_clone->ip_data = *dp->nh.iph;
+	dp_clone->nh.iph = &dp_clone->ip_data;
+
+	if (dp->p)
+		dp_clone->p = dp->p->refcopy();
+#else
+	memcpy(dp_clone->ip_data, dp->nh.raw, dp->nh.iph->ihl << 2);
+	dp_clone->nh.raw = dp_clone->ip_data;
+
+	if (dp->skb) {
+		struct sk_buff *skb;
+
+		skb = skb_clone(dp->skb, GFP_ATOMIC);
+
+		if (!skb)
+			goto out_err;
+
+		if (dp->payload && dp->payload >= (char *)skb->data &&
+		    dp->payload <= (char *)skb->tail) {
+			skb_pull(skb, dp->payload - (char *)skb->data);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
+			skb_header_release(skb);
+#endif
+		}
+		dp_clone->skb = skb;
+	}
+#endif
+	dsr_opts_len = dsr_pkt_opts_len(dp);
+
+	if (dsr_opts_len) {
+		if (!dsr_pkt_alloc_opts_reserve(dp_clone, dsr_opts_len, 0))
+			goto out_err;
+
+		memcpy(dp_clone->dh.raw, dp->dh.raw, dsr_opts_len);
+
+		dp_clone->srt_opt = dp->srt_opt;
+		dp_clone->ack_req_opt = dp->ack_req_opt;
+		dp_clone->probe_opt = dp->probe_opt;
+		dp_clone->num_rreq_opts = dp->num_rreq_opts;
+		dp_clone->num_rrep_opts = dp->num_rrep_opts;
+		dp_clone->num_rerr_opts = dp->num_rerr_opts;
+		dp_clone->num_ack_opts = dp->num_ack_opts;
+
+		for (i = 0; i < dp->num_rreq_opts; i++)
+			dp_clone->rreq_opt[i] = dp->rreq_opt[i];
+		for (i = 0; i < dp->num_rrep_opts; i++)
+			dp_clone->rrep_opt[i] = dp->rrep_opt[i];
+		for (i = 0; i < dp->num_rerr_opts; i++)
+			dp_clone->rerr_opt[i] = dp->rerr_opt[i];
+		for (i = 0; i < dp->num_ack_opts; i++)
+			dp_clone->ack_opt[i] = dp->ack_opt[i];
+
+		dsr_pkt_opts_rebase(dp_clone, dp->dh.raw, dp_clone->dh.raw, 0);
+	}
+	return dp_clone;
+      out_err:
+#ifdef NS2
+	if (dp_clone->p)
+		Packet::free(dp_clone->p);
+#endif
+	dsr_pkt_free(dp_clone);
+	return NULL;
+}
+
 void dsr_pkt_free(struct dsr_pkt *dp)
 {
 
@@ -212,7 +527,7 @@ void dsr_pkt_free(struct dsr_pkt *dp)
 	if (dp->srt)
 		FREE(dp->srt);
 
-	FREE(dp);
+	dsr_pkt_put(dp);
 
 	return;
 }
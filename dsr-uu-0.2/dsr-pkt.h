@@ -15,12 +15,11 @@
 #include <linux/in.h>
 #endif
 
+#define MAX_RREQ_OPTS 8
 #define MAX_RREP_OPTS 10
 #define MAX_RERR_OPTS 10
 #define MAX_ACK_OPTS  10
 
-#define DEFAULT_TAILROOM 128
-
 /* Internal representation of a packet. For portability */
 struct dsr_pkt {
 	struct in_addr src;	/* IP level data */ //Դڵ
@@ -60,11 +59,12 @@ struct dsr_pkt {
 		
 	int num_rrep_opts, num_rerr_opts, num_rreq_opts, num_ack_opts;
 	struct dsr_srt_opt *srt_opt;
-	struct dsr_rreq_opt *rreq_opt;	/* Can only be one */
+	struct dsr_rreq_opt *rreq_opt[MAX_RREQ_OPTS];	/* Several if batched */
 	struct dsr_rrep_opt *rrep_opt[MAX_RREP_OPTS];
 	struct dsr_rerr_opt *rerr_opt[MAX_RERR_OPTS];
 	struct dsr_ack_opt *ack_opt[MAX_ACK_OPTS];
 	struct dsr_ack_req_opt *ack_req_opt;
+	struct dsr_probe_opt *probe_opt;
 	struct dsr_srt *srt;	/* Source route */
 
 
@@ -84,6 +84,7 @@ struct dsr_pkt {
 #define PKT_REQUEST_ACK  0x02
 #define PKT_PASSIVE_ACK  0x04
 #define PKT_XMIT_JITTER  0x08
+#define PKT_LL_FEEDBACK  0x10
 
 /* Packet actions: */
 #define DSR_PKT_NONE           1
@@ -115,8 +116,15 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p);
 struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb);
 #endif
 char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len);
+char *dsr_pkt_alloc_opts_reserve(struct dsr_pkt *dp, int len, int reserve);
 char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len);
+char *dsr_pkt_opts_insert(struct dsr_pkt *dp, char *pos, int len);
+int dsr_pkt_opts_resize(struct dsr_pkt *dp, char *opt, int old_len,
+			int new_len);
+struct dsr_pkt *dsr_pkt_clone(struct dsr_pkt *dp);
 void dsr_pkt_free(struct dsr_pkt *dp);
 int dsr_pkt_free_opts(struct dsr_pkt *dp);
+int dsr_pkt_cache_init(void);
+void dsr_pkt_cache_cleanup(void);
 
 #endif				/* _DSR_PKT_H */
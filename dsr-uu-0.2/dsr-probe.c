@@ -0,0 +1,202 @@
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifdef __KERNEL__
+#include <linux/random.h>
+#include "dsr-dev.h"
+#endif
+
+#ifdef NS2
+#include "ns-agent.h"
+#include <tools/random.h>
+#endif
+
+#include "tbl.h"
+#include "debug.h"
+#include "dsr-opt.h"
+#include "dsr-probe.h"
+#include "link-cache.h"
+#include "neigh.h"
+
+/* Neighbor sensing. Every ProbeInterval a small probe is broadcast to the
+ * neighbors, carrying the share of their probes that this node received.
+ * From the probes a node receives it learns the delivery ratio in both
+ * directions of each link, see neigh.c. */
+
+#ifdef __KERNEL__
+static DSRUUTimer probe_timer;
+static unsigned short probe_seq;
+#endif
+
+int NSCLASS dsr_probe_send(void)
+{
+	struct dsr_pkt *dp;
+	struct dsr_probe_opt *probe;
+	struct dsr_probe_lq lq[DSR_PROBE_MAX_LQ];
+	int n, len;
+	char *buf;
+
+	n = neigh_tbl_probe_fill(lq, DSR_PROBE_MAX_LQ);
+
+	len = DSR_OPT_HDR_LEN + DSR_PROBE_HDR_LEN +
+	    n * sizeof(struct dsr_probe_lq);
+
+	dp = dsr_pkt_alloc(NULL);
+
+	if (!dp)
+		return -1;
+
+	dp->dst.s_addr = DSR_BROADCAST;
+	dp->nxt_hop.s_addr = DSR_BROADCAST;
+	dp->src = my_addr();
+
+	buf = dsr_pkt_alloc_opts(dp, len);
+
+	if (!buf)
+		goto out_err;
+
+	/* Probes are for neighbors only */
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+				  IP_HDR_LEN + len, IPPROTO_DSR, 1);
+
+	if (!dp->nh.iph) {
+		DEBUG("Could not create IP header\n");
+		goto out_err;
+	}
+
+	dp->dh.opth = dsr_opt_hdr_add(buf, len, DSR_NO_NEXT_HDR_TYPE);
+
+	if (!dp->dh.opth) {
+		DEBUG("Could not create DSR opt header\n");
+		goto out_err;
+	}
+
+	buf += DSR_OPT_HDR_LEN;
+
+	probe = (struct dsr_probe_opt *)buf;
+	probe->type = DSR_OPT_PROBE;
+	probe->length = DSR_PROBE_OPT_LEN(n);
+	probe->seq = htons(probe_seq++);
+	probe->interval = htons(ConfVal(ProbeInterval));
+	probe->res = 0;
+
+	memcpy(probe->lq, lq, n * sizeof(struct dsr_probe_lq));
+
+	DEBUG("Sending probe seq=%u neighbors=%d\n", ntohs(probe->seq), n);
+
+	dp->flags |= PKT_XMIT_JITTER;
+
+	XMIT(dp);
+
+	return 1;
+
+      out_err:
+	dsr_pkt_free(dp);
+	return -1;
+}
+
+int NSCLASS dsr_probe_opt_recv(struct dsr_pkt *dp, struct dsr_probe_opt *probe)
+{
+	struct in_addr myaddr;
+	int i, n, fwd_lq = -1;
+
+	if (!dp || !probe || dp->flags & PKT_PROMISC_RECV)
+		return DSR_PKT_ERROR;
+
+	myaddr = my_addr();
+
+	if (dp->src.s_addr == myaddr.s_addr)
+		return DSR_PKT_DROP;
+
+	n = (probe->length - DSR_PROBE_OPT_LEN(0)) /
+	    sizeof(struct dsr_probe_lq);
+
+	/* Our share of probes received by the neighbor */
+	for (i = 0; i < n; i++) {
+		if (probe->lq[i].addr == myaddr.s_addr) {
+			fwd_lq = probe->lq[i].lq;
+			break;
+		}
+	}
+
+	/* Not listed, so the neighbor has not heard from us. Unless the list
+	 * was cut short, then we just do not know */
+	if (fwd_lq < 0 && n < (int)DSR_PROBE_MAX_LQ)
+		fwd_lq = 0;
+
+	neigh_tbl_add(dp->src, dp->mac.ethh);
+
+	neigh_tbl_probe_recv(dp->src, ntohs(probe->seq),
+			     ntohs(probe->interval) * 1000, fwd_lq);
+
+	lc_link_add(myaddr, dp->src, ConfValToUsecs(RouteCacheTimeout), 0,
+		    neigh_tbl_link_cost(dp->src));
+
+	DEBUG("Probe from %s seq=%u fwd_lq=%d\n", print_ip(dp->src),
+	      ntohs(probe->seq), fwd_lq);
+
+	return DSR_PKT_NONE;
+}
+
+/* Arm the probe timer, e.g., after ProbeInterval has been changed */
+void NSCLASS dsr_probe_start(void)
+{
+	struct timeval expires;
+	usecs_t interval = ConfValToUsecs(ProbeInterval);
+	usecs_t jitter;
+
+	if (!interval)
+		return;
+
+	/* Send at random within +-25 % of the interval, so that neighbors
+	 * do not stay synchronized */
+#ifdef NS2
+	jitter = (usecs_t)(Random::uniform() * (interval / 2));
+#else
+	get_random_bytes(&jitter, sizeof(jitter));
+	jitter %= (interval / 2 + 1);
+#endif
+	gettime(&expires);
+	timeval_add_usecs(&expires, interval - interval / 4 + jitter);
+
+	set_timer(&probe_timer, &expires);
+}
+
+void NSCLASS dsr_probe_timeout(unsigned long data)
+{
+	if (!ConfVal(ProbeInterval))
+		return;
+
+	neigh_tbl_probe_tick();
+
+	dsr_probe_send();
+
+	dsr_probe_start();
+}
+
+int __init NSCLASS dsr_probe_init(void)
+{
+	init_timer(&probe_timer);
+
+	probe_timer.function = &NSCLASS dsr_probe_timeout;
+	probe_timer.data = 0;
+
+#ifdef __KERNEL__
+	get_random_bytes(&probe_seq, sizeof(probe_seq));
+#else
+	probe_seq = 0;
+#endif
+	dsr_probe_start();
+
+	return 0;
+}
+
+void __exit NSCLASS dsr_probe_cleanup(void)
+{
+	if (timer_pending(&probe_timer))
+		del_timer_sync(&probe_timer);
+}
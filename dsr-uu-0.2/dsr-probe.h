@@ -0,0 +1,51 @@
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifndef _DSR_PROBE_H
+#define _DSR_PROBE_H
+
+#include "dsr.h"
+
+#ifndef NO_GLOBALS
+
+/* Delivery ratio of the probes received from a neighbor */
+struct dsr_probe_lq {
+	u_int32_t addr;
+	u_int8_t lq;		/* 0 - NEIGH_LQ_MAX */
+	u_int8_t res[3];
+};
+
+/* Neighbor probe, broadcast to one hop. Not in the draft. */
+struct dsr_probe_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int16_t seq;
+	u_int16_t interval;	/* Milliseconds until the next probe */
+	u_int16_t res;
+	struct dsr_probe_lq lq[0];
+};
+
+#define DSR_PROBE_HDR_LEN sizeof(struct dsr_probe_opt)
+#define DSR_PROBE_OPT_LEN(n) (DSR_PROBE_HDR_LEN - 2 + \
+			      (n) * sizeof(struct dsr_probe_lq))
+#define DSR_PROBE_MAX_LQ ((255 - DSR_PROBE_OPT_LEN(0)) / \
+			  sizeof(struct dsr_probe_lq))
+
+#endif				/* NO_GLOBALS */
+
+#ifndef NO_DECLS
+
+int dsr_probe_send(void);
+int dsr_probe_opt_recv(struct dsr_pkt *dp, struct dsr_probe_opt *probe);
+void dsr_probe_start(void);
+void dsr_probe_timeout(unsigned long data);
+int dsr_probe_init(void);
+void dsr_probe_cleanup(void);
+
+#endif				/* NO_DECLS */
+
+#endif				/* _DSR_PROBE_H */
@@ -208,9 +208,7 @@ int NSCLASS dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *rerr_opt)
 	struct in_addr err_src, err_dst, unr_addr;
 
 	if (!rerr_opt)
-		return -1;
-	
-	dp->rerr_opt[dp->num_rerr_opts++] = rerr_opt;
+		return DSR_PKT_ERROR;
 
 	switch (rerr_opt->err_type) {
 	case NODE_UNREACHABLE:
@@ -240,5 +238,5 @@ int NSCLASS dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *rerr_opt)
 		break;
 	}
 
-	return 0;
+	return DSR_PKT_NONE;
 }
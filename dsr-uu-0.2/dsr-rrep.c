@@ -332,11 +332,6 @@ int NSCLASS dsr_rrep_opt_recv(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt)
 
 	if (!dp || !rrep_opt || dp->flags & PKT_PROMISC_RECV)
 		return DSR_PKT_ERROR;
-	
-	if (dp->num_rrep_opts < MAX_RREP_OPTS)
-		dp->rrep_opt[dp->num_rrep_opts++] = rrep_opt;
-	else
-		return DSR_PKT_ERROR;
 
 	myaddr = my_addr();
 	
@@ -15,6 +15,7 @@
 #endif
 
 #ifdef NS2
+#include <tools/random.h>
 #include "ns-agent.h"
 #endif
 
@@ -32,70 +33,161 @@
 
 #define RREQ_TBL_PROC_NAME "dsr_rreq_tbl"
 
+/* Entries in LRU order, also hashed on node address in rreq_tbl_idx */
 static TBL(rreq_tbl, RREQ_TBL_MAX_LEN);
+static list_t rreq_tbl_idx[RREQ_TBL_HASH_SIZE];
 static unsigned int rreq_seqno;
+
+/* Entries in route discovery, sorted on retransmission deadline */
+static LIST_HEAD(rreq_disc_list);
+static DSRUUTimer rreq_tbl_timer;
+
+/* Targets waiting to share the next RREQ when batching is enabled */
+static struct rreq_batch rreq_batch;
+static DSRUUTimer rreq_batch_timer;
+
+/* RREQs waiting for their jittered rebroadcast, sorted on expiry */
+static TBL(rreq_fwd_tbl, RREQ_FWD_TBL_MAX_LEN);
+static DSRUUTimer rreq_fwd_timer;
 #endif
 
 #ifndef MAXTTL
 #define MAXTTL 255
 #endif
 
+#define	TTL_START 1
+
 #define STATE_IDLE          0
 #define STATE_IN_ROUTE_DISC 1
 
+/* Max number of (target, id) pairs remembered per initiator, regardless of
+ * RequestTableIds */
+#define RREQ_TBL_MAX_IDS 32
+
+struct id_entry {
+	struct in_addr trg_addr;
+	unsigned short id;
+};
+
 struct rreq_tbl_entry {
 	list_t l;
+	list_t hl;		/* Hash chain */
 	int state;
 	struct in_addr node_addr;
 	int ttl;
-	DSRUUTimer *timer;
+	list_t dl;		/* Discovery list, only in STATE_IN_ROUTE_DISC */
+	struct timeval expires;
 	struct timeval tx_time;
 	struct timeval last_used;
 	usecs_t timeout;
 	unsigned int num_rexmts;
-	struct tbl rreq_id_tbl;
+	/* Ring of the most recent RREQ ids seen from this node */
+	unsigned int num_ids;
+	unsigned int id_next;
+	struct id_entry ids[RREQ_TBL_MAX_IDS];
 };
 
-struct id_entry {
+struct rreq_fwd_entry {
 	list_t l;
-	struct in_addr trg_addr;
+	struct in_addr initiator;
+	struct in_addr target;
 	unsigned short id;
-};
-struct rreq_tbl_query {
-	struct in_addr *initiator;
-	struct in_addr *target;
-	unsigned int *id;
+	unsigned int copies;	/* Copies heard, including our own */
+	struct timeval expires;
+	struct dsr_pkt *dp;
 };
 
-static inline int crit_addr(void *pos, void *data)
+static inline int crit_fwd_expires(void *pos, void *data)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
-	struct in_addr *a = (struct in_addr *)data;
+	struct rreq_fwd_entry *p = (struct rreq_fwd_entry *)pos;
+	struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)data;
 
-	if (e->node_addr.s_addr == a->s_addr)
+	if (timeval_diff(&p->expires, &e->expires) > 0)
 		return 1;
 	return 0;
 }
 
-static inline int crit_duplicate(void *pos, void *data)
+static inline int crit_fwd_query(void *pos, void *data)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
-	struct rreq_tbl_query *q = (struct rreq_tbl_query *)data;
+	struct rreq_fwd_entry *p = (struct rreq_fwd_entry *)pos;
+	struct rreq_fwd_entry *q = (struct rreq_fwd_entry *)data;
 
-	if (e->node_addr.s_addr == q->initiator->s_addr) {
-		list_t *p;
+	if (p->initiator.s_addr == q->initiator.s_addr &&
+	    p->target.s_addr == q->target.s_addr && p->id == q->id)
+		return 1;
+	return 0;
+}
 
-		list_for_each(p, &e->rreq_id_tbl.head) {
-			struct id_entry *id_e = (struct id_entry *)p;
+static inline int crit_fwd_expired(void *pos, void *data)
+{
+	struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)pos;
+	struct timeval *now = (struct timeval *)data;
 
-			if (id_e->trg_addr.s_addr == q->target->s_addr &&
-			    id_e->id == *(q->id))
-				return 1;
-		}
-	}
+	if (timeval_diff(&e->expires, now) <= 0)
+		return 1;
 	return 0;
 }
 
+static inline unsigned int rreq_tbl_hash(struct in_addr addr)
+{
+	return (addr.s_addr ^ (addr.s_addr >> 16)) % RREQ_TBL_HASH_SIZE;
+}
+
+struct rreq_tbl_entry *NSCLASS __rreq_tbl_find(struct in_addr node_addr)
+{
+	list_t *pos;
+
+	list_for_each(pos, &rreq_tbl_idx[rreq_tbl_hash(node_addr)]) {
+		struct rreq_tbl_entry *e;
+
+		e = list_entry(pos, struct rreq_tbl_entry, hl);
+
+		if (e->node_addr.s_addr == node_addr.s_addr)
+			return e;
+	}
+	return NULL;
+}
+
+/* Insert an entry in the discovery list and make sure the timer fires for
+ * the earliest deadline */
+void NSCLASS __rreq_disc_add(struct rreq_tbl_entry *e)
+{
+	list_t *pos;
+
+	list_for_each(pos, &rreq_disc_list) {
+		struct rreq_tbl_entry *p;
+
+		p = list_entry(pos, struct rreq_tbl_entry, dl);
+
+		if (timeval_diff(&p->expires, &e->expires) > 0)
+			break;
+	}
+	list_add(&e->dl, pos->prev);
+
+	if (rreq_disc_list.next == &e->dl)
+		set_timer(&rreq_tbl_timer, &e->expires);
+}
+
+void NSCLASS __rreq_disc_del(struct rreq_tbl_entry *e)
+{
+	int first = (rreq_disc_list.next == &e->dl);
+
+	list_del(&e->dl);
+
+	if (!first)
+		return;
+
+	if (list_empty(&rreq_disc_list)) {
+		if (timer_pending(&rreq_tbl_timer))
+			del_timer(&rreq_tbl_timer);
+	} else {
+		struct rreq_tbl_entry *n;
+
+		n = list_entry(rreq_disc_list.next, struct rreq_tbl_entry, dl);
+		set_timer(&rreq_tbl_timer, &n->expires);
+	}
+}
+
 void NSCLASS rreq_tbl_set_max_len(unsigned int max_len)
 {
 	rreq_tbl.max_len = max_len;
@@ -103,9 +195,8 @@ void NSCLASS rreq_tbl_set_max_len(unsigned int max_len)
 #ifdef __KERNEL__
 static int rreq_tbl_print(struct tbl *t, char *buf)
 {
-	list_t *pos1, *pos2;
+	list_t *pos;
 	int len = 0;
-	int first = 1;
 	struct timeval now;
 
 	gettime(&now);
@@ -116,31 +207,30 @@ static int rreq_tbl_print(struct tbl *t, char *buf)
 	    sprintf(buf, "# %-15s %-6s %-8s %15s:%s\n", "IPAddr", "TTL", "Used",
 		    "TargetIPAddr", "ID");
 
-	list_for_each(pos1, &t->head) {
-		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos1;
+	list_for_each(pos, &t->head) {
+		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
 		struct id_entry *id_e;
+		unsigned int i;
 
-		if (TBL_EMPTY(&e->rreq_id_tbl))
+		if (e->num_ids == 0)
 			len +=
 			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%s\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    "-", "-");
 		else {
-			id_e = (struct id_entry *)TBL_FIRST(&e->rreq_id_tbl);
+			id_e = &e->ids[0];
 			len +=
 			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%u\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    print_ip(id_e->trg_addr), id_e->id);
 		}
-		list_for_each(pos2, &e->rreq_id_tbl.head) {
-			id_e = (struct id_entry *)pos2;
-			if (!first)
-				len +=
-				    sprintf(buf + len, "%49s:%u\n",
-					    print_ip(id_e->trg_addr), id_e->id);
-			first = 0;
+		for (i = 1; i < e->num_ids; i++) {
+			id_e = &e->ids[i];
+			len +=
+			    sprintf(buf + len, "%49s:%u\n",
+				    print_ip(id_e->trg_addr), id_e->id);
 		}
 	}
 
@@ -152,53 +242,109 @@ static int rreq_tbl_print(struct tbl *t, char *buf)
 
 void NSCLASS rreq_tbl_timeout(unsigned long data)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)data;
-	struct timeval expires;
+	struct rreq_tbl_entry *e;
+	struct in_addr targets[MAX_RREQ_OPTS];
+	struct timeval now;
+	int n, max_n, ttl = 0;
 
-	if (!e)
-		return;
+	gettime(&now);
+
+	/* With batching, discoveries that are due together with the same TTL
+	 * share one RREQ */
+	max_n = ConfVal(RREQBatchWindow) ? MAX_RREQ_OPTS : 1;
 
-	tbl_detach(&rreq_tbl, &e->l);
+	DSR_WRITE_LOCK(&rreq_tbl.lock);
 
-	DEBUG("RREQ Timeout dst=%s timeout=%lu rexmts=%d \n",
-	      print_ip(e->node_addr), e->timeout, e->num_rexmts);
+	/* Retransmit every discovery that is due. The lock is dropped while
+	 * sending so the list is rechecked from the head each round. */
+	do {
+		n = 0;
 
-	if (e->num_rexmts >= ConfVal(MaxRequestRexmt)) {
-		DEBUG("MAX RREQs reached for %s\n", print_ip(e->node_addr));
+		while (!list_empty(&rreq_disc_list) && n < max_n) {
+			int next_ttl;
 
-		e->state = STATE_IDLE;
+			e = list_entry(rreq_disc_list.next,
+				       struct rreq_tbl_entry, dl);
 
-/* 		DSR_WRITE_UNLOCK(&rreq_tbl); */
-		tbl_add_tail(&rreq_tbl, &e->l);
-		return;
-	}
+			if (timeval_diff(&e->expires, &now) > 0)
+				break;
 
-	e->num_rexmts++;
+			DEBUG("RREQ Timeout dst=%s timeout=%lu rexmts=%d \n",
+			      print_ip(e->node_addr), e->timeout,
+			      e->num_rexmts);
 
-	/* if (e->ttl == 1) */
-/* 		e->timeout = ConfValToUsecs(RequestPeriod);  */
-/* 	else */
-	e->timeout *= 2;	/* Double timeout */
+			if (e->num_rexmts >= ConfVal(MaxRequestRexmt)) {
+				DEBUG("MAX RREQs reached for %s\n",
+				      print_ip(e->node_addr));
+				list_del(&e->dl);
+				e->state = STATE_IDLE;
+				continue;
+			}
 
-	e->ttl *= 2;		/* Double TTL */
+			next_ttl = e->ttl * 2;	/* Double TTL */
 
-	if (e->ttl > MAXTTL)
-		e->ttl = MAXTTL;
+			if (next_ttl > MAXTTL)
+				next_ttl = MAXTTL;
 
-	if (e->timeout > ConfValToUsecs(MaxRequestPeriod))
-		e->timeout = ConfValToUsecs(MaxRequestPeriod);
+			if (n > 0 && next_ttl != ttl)
+				break;
 
-	gettime(&e->last_used);
+			list_del(&e->dl);
 
-	dsr_rreq_send(e->node_addr, e->ttl);
+			e->num_rexmts++;
+			e->ttl = next_ttl;
+			e->timeout *= 2;	/* Double timeout */
 
-	expires = e->last_used;
-	timeval_add_usecs(&expires, e->timeout);
+			if (e->timeout > ConfValToUsecs(MaxRequestPeriod))
+				e->timeout = ConfValToUsecs(MaxRequestPeriod);
 
-	/* Put at end of list */
-	tbl_add_tail(&rreq_tbl, &e->l);
+			e->last_used = now;
+			e->expires = now;
+			timeval_add_usecs(&e->expires, e->timeout);
 
-	set_timer(e->timer, &expires);
+			/* Put at end of list */
+			__tbl_detach(&rreq_tbl, &e->l);
+			__tbl_add_tail(&rreq_tbl, &e->l);
+
+			__rreq_disc_add(e);
+
+			targets[n++] = e->node_addr;
+			ttl = e->ttl;
+		}
+
+		if (n == 0)
+			break;
+
+		DSR_WRITE_UNLOCK(&rreq_tbl.lock);
+
+		dsr_rreq_send_multi(targets, n, ttl);
+
+		DSR_WRITE_LOCK(&rreq_tbl.lock);
+	} while (1);
+
+	if (!list_empty(&rreq_disc_list)) {
+		e = list_entry(rreq_disc_list.next, struct rreq_tbl_entry, dl);
+		set_timer(&rreq_tbl_timer, &e->expires);
+	}
+
+	DSR_WRITE_UNLOCK(&rreq_tbl.lock);
+}
+
+void NSCLASS rreq_batch_timeout(unsigned long data)
+{
+	struct in_addr targets[MAX_RREQ_OPTS];
+	int n;
+
+	DSR_WRITE_LOCK(&rreq_tbl.lock);
+
+	n = rreq_batch.len;
+	memcpy(targets, rreq_batch.targets, n * sizeof(struct in_addr));
+	rreq_batch.len = 0;
+
+	DSR_WRITE_UNLOCK(&rreq_tbl.lock);
+
+	if (n)
+		dsr_rreq_send_multi(targets, n, TTL_START);
 }
 
 struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
@@ -216,23 +362,8 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
 	e->ttl = 0;
 	memset(&e->tx_time, 0, sizeof(struct timeval));;
 	e->num_rexmts = 0;
-#ifdef NS2
-	e->timer = new DSRUUTimer(this, "RREQTblTimer");
-#else
-	e->timer = MALLOC(sizeof(DSRUUTimer), GFP_ATOMIC);
-#endif
-
-	if (!e->timer) {
-		FREE(e);
-		return NULL;
-	}
-
-	init_timer(e->timer);
-
-	e->timer->function = &NSCLASS rreq_tbl_timeout;
-	e->timer->data = (unsigned long)e;
-
-	INIT_TBL(&e->rreq_id_tbl, ConfVal(RequestTableIds));
+	e->num_ids = 0;
+	e->id_next = 0;
 
 	return e;
 }
@@ -252,18 +383,14 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_add(struct in_addr node_addr)
 		f = (struct rreq_tbl_entry *)TBL_FIRST(&rreq_tbl);
 
 		__tbl_detach(&rreq_tbl, &f->l);
+		list_del(&f->hl);
 
-		del_timer_sync(f->timer);
-#ifdef NS2
-		delete f->timer;
-#else
-		FREE(f->timer);
-#endif
-		tbl_flush(&f->rreq_id_tbl, NULL);
-
+		if (f->state == STATE_IN_ROUTE_DISC)
+			__rreq_disc_del(f);
 		FREE(f);
 	}
 	__tbl_add_tail(&rreq_tbl, &e->l);
+	list_add(&e->hl, &rreq_tbl_idx[rreq_tbl_hash(node_addr)]);
 
 	return e;
 }
@@ -273,13 +400,12 @@ rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
 		unsigned short id)
 {
 	struct rreq_tbl_entry *e;
-	struct id_entry *id_e;
+	unsigned int max_ids;
 	int res = 0;
 
 	DSR_WRITE_LOCK(&rreq_tbl.lock);
 
-	e = (struct rreq_tbl_entry *)__tbl_find(&rreq_tbl, &initiator,
-						crit_addr);
+	e = __rreq_tbl_find(initiator);
 
 	if (!e)
 		e = __rreq_tbl_add(initiator);
@@ -296,20 +422,23 @@ rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
 
 	gettime(&e->last_used);
 
-	if (TBL_FULL(&e->rreq_id_tbl))
-		tbl_del_first(&e->rreq_id_tbl);
+	max_ids = ConfVal(RequestTableIds);
 
-	id_e = (struct id_entry *)MALLOC(sizeof(struct id_entry), GFP_ATOMIC);
+	if (max_ids > RREQ_TBL_MAX_IDS)
+		max_ids = RREQ_TBL_MAX_IDS;
+	else if (max_ids == 0)
+		max_ids = 1;
 
-	if (!id_e) {
-		res = -ENOMEM;
-		goto out;
-	}
+	/* Overwrite the oldest id once the ring is full */
+	if (e->id_next >= max_ids)
+		e->id_next = 0;
 
-	id_e->trg_addr = target;
-	id_e->id = id;
+	e->ids[e->id_next].trg_addr = target;
+	e->ids[e->id_next].id = id;
+	e->id_next++;
 
-	tbl_add_tail(&e->rreq_id_tbl, &id_e->l);
+	if (e->num_ids < max_ids)
+		e->num_ids++;
       out:
 	DSR_WRITE_UNLOCK(&rreq_tbl.lock);
 
@@ -320,21 +449,39 @@ int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst)
 {
 	struct rreq_tbl_entry *e;
 
-	e = (struct rreq_tbl_entry *)tbl_find_detach(&rreq_tbl, &dst,
-						     crit_addr);
+	DSR_WRITE_LOCK(&rreq_tbl.lock);
+
+	e = __rreq_tbl_find(dst);
 
 	if (!e) {
+		DSR_WRITE_UNLOCK(&rreq_tbl.lock);
 		DEBUG("%s not in RREQ table\n", print_ip(dst));
 		return -1;
 	}
+	__tbl_detach(&rreq_tbl, &e->l);
+
+	if (e->state == STATE_IN_ROUTE_DISC) {
+		int i;
 
-	if (e->state == STATE_IN_ROUTE_DISC)
-		del_timer_sync(e->timer);
+		__rreq_disc_del(e);
+
+		/* Do not ask for it in a pending batch either */
+		for (i = 0; i < rreq_batch.len; i++) {
+			if (rreq_batch.targets[i].s_addr != dst.s_addr)
+				continue;
+
+			rreq_batch.targets[i] =
+			    rreq_batch.targets[--rreq_batch.len];
+			break;
+		}
+	}
 
 	e->state = STATE_IDLE;
 	gettime(&e->last_used);
 
-	tbl_add_tail(&rreq_tbl, &e->l);
+	__tbl_add_tail(&rreq_tbl, &e->l);
+
+	DSR_WRITE_UNLOCK(&rreq_tbl.lock);
 
 	return 1;
 }
@@ -343,13 +490,10 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 {
 	struct rreq_tbl_entry *e;
 	int ttl, res = 0;
-	struct timeval expires;
-
-#define	TTL_START 1
 
 	DSR_WRITE_LOCK(&rreq_tbl.lock);
 
-	e = (struct rreq_tbl_entry *)__tbl_find(&rreq_tbl, &target, crit_addr);
+	e = __rreq_tbl_find(target);
 
 	if (!e)
 		e = __rreq_tbl_add(target);
@@ -384,10 +528,50 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 	e->state = STATE_IN_ROUTE_DISC;
 	e->num_rexmts = 0;
 
-	expires = e->last_used;
-	timeval_add_usecs(&expires, e->timeout);
+	if (ConfVal(RREQBatchWindow)) {
+		struct in_addr targets[MAX_RREQ_OPTS];
+		int n;
+
+		/* Hold the RREQ for a short while so that discoveries started
+		 * together share one flood. Their retransmissions then fall
+		 * due together as well. */
+		if (rreq_batch.len == 0) {
+			rreq_batch.sent = e->last_used;
+			timeval_add_usecs(&rreq_batch.sent,
+					  ConfValToUsecs(RREQBatchWindow));
+			set_timer(&rreq_batch_timer, &rreq_batch.sent);
+		}
+		rreq_batch.targets[rreq_batch.len++] = target;
+
+		e->last_used = rreq_batch.sent;
+		e->expires = e->last_used;
+		timeval_add_usecs(&e->expires, e->timeout);
+
+		__rreq_disc_add(e);
+
+		res = 1;
+
+		if (rreq_batch.len < MAX_RREQ_OPTS)
+			goto out;
+
+		n = rreq_batch.len;
+		memcpy(targets, rreq_batch.targets, n * sizeof(struct in_addr));
+		rreq_batch.len = 0;
+
+		if (timer_pending(&rreq_batch_timer))
+			del_timer(&rreq_batch_timer);
+
+		DSR_WRITE_UNLOCK(&rreq_tbl.lock);
+
+		dsr_rreq_send_multi(targets, n, ttl);
+
+		return 1;
+	}
+
+	e->expires = e->last_used;
+	timeval_add_usecs(&e->expires, e->timeout);
 
-	set_timer(e->timer, &expires);
+	__rreq_disc_add(e);
 
 	DSR_WRITE_UNLOCK(&rreq_tbl.lock);
 
@@ -403,17 +587,28 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 int NSCLASS dsr_rreq_duplicate(struct in_addr initiator, struct in_addr target,
 			       unsigned int id)
 {
-	struct {
-		struct in_addr *initiator;
-		struct in_addr *target;
-		unsigned int *id;
-	} d;
+	struct rreq_tbl_entry *e;
+	unsigned int i;
+	int res = 0;
+
+	DSR_READ_LOCK(&rreq_tbl.lock);
 
-	d.initiator = &initiator;
-	d.target = &target;
-	d.id = &id;
+	e = __rreq_tbl_find(initiator);
+
+	if (!e)
+		goto out;
+
+	for (i = 0; i < e->num_ids; i++) {
+		if (e->ids[i].id == id &&
+		    e->ids[i].trg_addr.s_addr == target.s_addr) {
+			res = 1;
+			break;
+		}
+	}
+ out:
+	DSR_READ_UNLOCK(&rreq_tbl.lock);
 
-	return in_tbl(&rreq_tbl, &d, crit_duplicate);
+	return res;
 }
 
 static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
@@ -435,11 +630,17 @@ static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
 	return rreq_opt;
 }
 
-int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
+/* Send one RREQ with an option for each target */
+int NSCLASS dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl)
 {
 	struct dsr_pkt *dp;
 	char *buf;
-	int len = DSR_OPT_HDR_LEN + DSR_RREQ_HDR_LEN;
+	int i, len;
+
+	if (n < 1 || n > MAX_RREQ_OPTS)
+		return -1;
+
+	len = DSR_OPT_HDR_LEN + n * DSR_RREQ_HDR_LEN;
 
 	dp = dsr_pkt_alloc(NULL);
 
@@ -474,17 +675,24 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	buf += DSR_OPT_HDR_LEN;
 	len -= DSR_OPT_HDR_LEN;
 
-	dp->rreq_opt = dsr_rreq_opt_add(buf, len, target, ++rreq_seqno);
+	for (i = 0; i < n; i++) {
+		dp->rreq_opt[i] = dsr_rreq_opt_add(buf, len, targets[i],
+						   ++rreq_seqno);
 
-	if (!dp->rreq_opt) {
-		DEBUG("Could not create RREQ opt\n");
-		goto out_err;
-	}
+		if (!dp->rreq_opt[i]) {
+			DEBUG("Could not create RREQ opt\n");
+			goto out_err;
+		}
+		dp->num_rreq_opts++;
+
+		buf += DSR_RREQ_HDR_LEN;
+		len -= DSR_RREQ_HDR_LEN;
 #ifdef NS2
-	DEBUG("Sending RREQ src=%s dst=%s target=%s ttl=%d iph->saddr()=%d\n",
-	      print_ip(dp->src), print_ip(dp->dst), print_ip(target), ttl,
-	      dp->nh.iph->saddr());
+		DEBUG("Sending RREQ src=%s dst=%s target=%s ttl=%d iph->saddr()=%d\n",
+		      print_ip(dp->src), print_ip(dp->dst),
+		      print_ip(targets[i]), ttl, dp->nh.iph->saddr());
 #endif
+	}
 
 	dp->flags |= PKT_XMIT_JITTER;
 
@@ -498,25 +706,201 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	return -1;
 }
 
-int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
+int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
+{
+	return dsr_rreq_send_multi(&target, 1, ttl);
+}
+
+void NSCLASS rreq_fwd_tbl_timeout(unsigned long data)
+{
+	struct rreq_fwd_entry *e;
+	struct timeval now, expires;
+
+	gettime(&now);
+
+	while ((e = (struct rreq_fwd_entry *)tbl_find_detach(&rreq_fwd_tbl,
+							     &now,
+							     crit_fwd_expired))) {
+		DEBUG("Rebroadcasting RREQ from %s id=%u copies=%u\n",
+		      print_ip(e->initiator), e->id, e->copies);
+		XMIT(e->dp);
+		FREE(e);
+	}
+
+	DSR_READ_LOCK(&rreq_fwd_tbl.lock);
+
+	if (TBL_EMPTY(&rreq_fwd_tbl)) {
+		DSR_READ_UNLOCK(&rreq_fwd_tbl.lock);
+		return;
+	}
+	e = (struct rreq_fwd_entry *)TBL_FIRST(&rreq_fwd_tbl);
+	expires = e->expires;
+
+	DSR_READ_UNLOCK(&rreq_fwd_tbl.lock);
+
+	set_timer(&rreq_fwd_timer, &expires);
+}
+
+/* Rebroadcast a RREQ. With counter based suppression (RREQSuppressCount > 0)
+ * the rebroadcast is held back for a random time of up to BroadCastJitter
+ * and cancelled if enough copies of the RREQ are heard in the meantime. */
+int NSCLASS dsr_rreq_fwd(struct dsr_pkt *dp)
+{
+	struct rreq_fwd_entry *e;
+	unsigned int jitter;
+	int res;
+
+	if (!dp || !dp->num_rreq_opts)
+		return -1;
+
+	if (ConfVal(RREQSuppressCount) == 0)
+		goto xmit;
+
+	e = (struct rreq_fwd_entry *)MALLOC(sizeof(*e), GFP_ATOMIC);
+
+	if (!e)
+		goto xmit;
+
+	e->initiator = dp->src;
+	e->target.s_addr = dp->rreq_opt[0]->target;
+	e->id = ntohs(dp->rreq_opt[0]->id);
+	e->copies = 1;
+	e->dp = dp;
+
+#ifdef NS2
+	jitter = (unsigned int)(Random::uniform() *
+				ConfValToUsecs(BroadCastJitter));
+#else
+	get_random_bytes(&jitter, sizeof(jitter));
+	jitter %= (ConfValToUsecs(BroadCastJitter) + 1);
+#endif
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires, jitter);
+
+	DSR_WRITE_LOCK(&rreq_fwd_tbl.lock);
+	res = __tbl_add(&rreq_fwd_tbl, &e->l, crit_fwd_expires);
+
+	if (res > 0 && tbl_is_first(&rreq_fwd_tbl, e))
+		set_timer(&rreq_fwd_timer, &e->expires);
+	DSR_WRITE_UNLOCK(&rreq_fwd_tbl.lock);
+
+	if (res < 0) {
+		FREE(e);
+		goto xmit;
+	}
+	return 0;
+ xmit:
+	XMIT(dp);
+	return 0;
+}
+
+/* Count a duplicate of a RREQ waiting for rebroadcast. Returns 1 if the
+ * rebroadcast was suppressed. */
+int NSCLASS rreq_fwd_tbl_dup(struct in_addr initiator, struct in_addr target,
+			     unsigned short id)
+{
+	struct rreq_fwd_entry q, *e;
+	int res = 0;
+
+	q.initiator = initiator;
+	q.target = target;
+	q.id = id;
+
+	DSR_WRITE_LOCK(&rreq_fwd_tbl.lock);
+
+	e = (struct rreq_fwd_entry *)__tbl_find(&rreq_fwd_tbl, &q,
+						crit_fwd_query);
+
+	if (e && ++e->copies >= ConfVal(RREQSuppressCount)) {
+		__tbl_detach(&rreq_fwd_tbl, &e->l);
+		res = 1;
+	}
+	DSR_WRITE_UNLOCK(&rreq_fwd_tbl.lock);
+
+	if (res) {
+		DEBUG("Suppressing RREQ from %s id=%u after %u copies\n",
+		      print_ip(initiator), id, e->copies);
+		dsr_pkt_free(e->dp);
+		FREE(e);
+	}
+	return res;
+}
+
+/* Remove RREQ option idx from a packet that is to be rebroadcast */
+static int dsr_rreq_opt_strip(struct dsr_pkt *dp, int idx)
+{
+	struct dsr_rreq_opt *rreq_opt = dp->rreq_opt[idx];
+	int i, len = rreq_opt->length + 2;
+
+	dp->rreq_opt[idx] = NULL;
+
+	if (dsr_pkt_opts_resize(dp, (char *)rreq_opt, len, 0) < 0)
+		return -1;
+
+	for (i = idx; i < dp->num_rreq_opts - 1; i++)
+		dp->rreq_opt[i] = dp->rreq_opt[i + 1];
+
+	dp->num_rreq_opts--;
+
+	dp->dh.opth->p_len = htons(ntohs(dp->dh.opth->p_len) - len);
+#ifdef __KERNEL__
+	dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+		     ntohs(dp->nh.iph->tot_len) - len, IPPROTO_DSR,
+		     dp->nh.iph->ttl);
+#endif
+	return 0;
+}
+
+/* Process every RREQ option in a packet. Targets that are not searched for
+ * any further are stripped before the packet is rebroadcast. */
+int NSCLASS dsr_rreq_opts_recv(struct dsr_pkt *dp)
+{
+	int res[MAX_RREQ_OPTS];
+	int i, n, action = 0;
+
+	n = dp->num_rreq_opts;
+
+	for (i = 0; i < n; i++) {
+		res[i] = dsr_rreq_opt_recv(dp, i);
+		action |= res[i];
+	}
+
+	if (!(action & DSR_PKT_FORWARD_RREQ))
+		return action;
+
+	/* Options that were answered set the IP destination to their target,
+	 * but the rebroadcast must still go to the broadcast address */
+#ifdef NS2
+	dp->nh.iph->daddr() = (nsaddr_t) dp->dst.s_addr;
+#else
+	dp->nh.iph->daddr = dp->dst.s_addr;
+#endif
+	if (n == 1)
+		return action;
+
+	for (i = n - 1; i >= 0; i--) {
+		if (res[i] & DSR_PKT_FORWARD_RREQ)
+			continue;
+
+		if (dsr_rreq_opt_strip(dp, i) < 0)
+			return DSR_PKT_ERROR;
+	}
+	return action;
+}
+
+int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, int idx)
 {
 	struct in_addr myaddr;
 	struct in_addr trg;
+	struct dsr_rreq_opt *rreq_opt;
 	struct dsr_srt *srt_rev, *srt_rc;
 	int action = DSR_PKT_NONE;
-	int i, n;
+	int i, n, first;
 
-	if (!dp || !rreq_opt || dp->flags & PKT_PROMISC_RECV)
+	if (!dp || idx >= dp->num_rreq_opts || dp->flags & PKT_PROMISC_RECV)
 		return DSR_PKT_DROP;
-	
-	dp->num_rreq_opts++;
-	
-	if (dp->num_rreq_opts > 1) {
-		DEBUG("More than one RREQ opt!!! - Ignoring\n");
-		return DSR_PKT_ERROR;
-	}
 
-	dp->rreq_opt = rreq_opt;
+	rreq_opt = dp->rreq_opt[idx];
 
 	myaddr = my_addr();
 	
@@ -524,13 +908,20 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 
 	if (dsr_rreq_duplicate(dp->src, trg, ntohs(rreq_opt->id))) {
 		DEBUG("Duplicate RREQ from %s\n", print_ip(dp->src));
+		rreq_fwd_tbl_dup(dp->src, trg, ntohs(rreq_opt->id));
 		return DSR_PKT_DROP;
 	}
 
 	rreq_tbl_add_id(dp->src, trg, ntohs(rreq_opt->id));
 
-	dp->srt = dsr_srt_new(dp->src, myaddr, DSR_RREQ_ADDRS_LEN(rreq_opt),
-			      (char *)rreq_opt->addrs);
+	/* All options of a batched RREQ have travelled the same path, so the
+	 * route only needs to be learned from the first one we process */
+	first = (dp->srt == NULL);
+
+	if (first)
+		dp->srt = dsr_srt_new(dp->src, myaddr,
+				      DSR_RREQ_ADDRS_LEN(rreq_opt),
+				      (char *)rreq_opt->addrs);
 
 	if (!dp->srt) {
 		DEBUG("Could not extract source route\n");
@@ -550,18 +941,20 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 	DEBUG("srt: %s\n", print_srt(dp->srt));
 	DEBUG("srt_rev: %s\n", print_srt(srt_rev));
 
-	dsr_rtc_add(srt_rev, ConfValToUsecs(RouteCacheTimeout), 0);
+	if (first) {
+		dsr_rtc_add(srt_rev, ConfValToUsecs(RouteCacheTimeout), 0);
 
-	/* Set previous hop */
-	if (srt_rev->laddrs > 0)
-		dp->prv_hop = srt_rev->addrs[0];
-	else
-		dp->prv_hop = srt_rev->dst;
+		/* Set previous hop */
+		if (srt_rev->laddrs > 0)
+			dp->prv_hop = srt_rev->addrs[0];
+		else
+			dp->prv_hop = srt_rev->dst;
 
-	neigh_tbl_add(dp->prv_hop, dp->mac.ethh);
+		neigh_tbl_add(dp->prv_hop, dp->mac.ethh);
 
-	/* Send buffered packets */
-	send_buf_set_verdict(SEND_BUF_SEND, srt_rev->dst);
+		/* Send buffered packets */
+		send_buf_set_verdict(SEND_BUF_SEND, srt_rev->dst);
+	}
 
 	if (rreq_opt->target == myaddr.s_addr) {
 
@@ -630,16 +1023,15 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 	} else {
 
 	rreq_forward:	
-		dsr_pkt_alloc_opts_expand(dp, sizeof(struct in_addr));
-
-		if (!DSR_LAST_OPT(dp, rreq_opt)) {
-			char *to, *from;
-			to = (char *)rreq_opt + rreq_opt->length + 2 +
-			    sizeof(struct in_addr);
-			from = (char *)rreq_opt + rreq_opt->length + 2;
-
-			memmove(to, from, sizeof(struct in_addr));
+		/* Make room for our address at the end of the RREQ option */
+		if (!dsr_pkt_opts_insert(dp, (char *)rreq_opt + 
+					 rreq_opt->length + 2,
+					 sizeof(struct in_addr))) {
+			action = DSR_PKT_ERROR;
+			goto out;
 		}
+		rreq_opt = dp->rreq_opt[idx];
+
 		rreq_opt->addrs[n] = myaddr.s_addr;
 		rreq_opt->length += sizeof(struct in_addr);
 
@@ -681,8 +1073,31 @@ rreq_tbl_proc_info(char *buffer, char **start, off_t offset, int length)
 
 int __init NSCLASS rreq_tbl_init(void)
 {
+	int i;
+
 	INIT_TBL(&rreq_tbl, RREQ_TBL_MAX_LEN);
 
+	for (i = 0; i < RREQ_TBL_HASH_SIZE; i++)
+		INIT_LIST(&rreq_tbl_idx[i]);
+
+	INIT_LIST(&rreq_disc_list);
+	init_timer(&rreq_tbl_timer);
+
+	rreq_tbl_timer.function = &NSCLASS rreq_tbl_timeout;
+	rreq_tbl_timer.data = 0;
+
+	rreq_batch.len = 0;
+	init_timer(&rreq_batch_timer);
+
+	rreq_batch_timer.function = &NSCLASS rreq_batch_timeout;
+	rreq_batch_timer.data = 0;
+
+	INIT_TBL(&rreq_fwd_tbl, RREQ_FWD_TBL_MAX_LEN);
+	init_timer(&rreq_fwd_timer);
+
+	rreq_fwd_timer.function = &NSCLASS rreq_fwd_tbl_timeout;
+	rreq_fwd_timer.data = 0;
+
 #ifdef __KERNEL__
 	proc_net_create(RREQ_TBL_PROC_NAME, 0, rreq_tbl_proc_info);
 	get_random_bytes(&rreq_seqno, sizeof(unsigned int));
@@ -695,15 +1110,25 @@ int __init NSCLASS rreq_tbl_init(void)
 void __exit NSCLASS rreq_tbl_cleanup(void)
 {
 	struct rreq_tbl_entry *e;
+	struct rreq_fwd_entry *f;
+
+	if (timer_pending(&rreq_tbl_timer))
+		del_timer_sync(&rreq_tbl_timer);
+
+	if (timer_pending(&rreq_batch_timer))
+		del_timer_sync(&rreq_batch_timer);
 
 	while ((e = (struct rreq_tbl_entry *)tbl_detach_first(&rreq_tbl))) {
-		del_timer_sync(e->timer);
-#ifdef NS2
-		delete e->timer;
-#else
-		FREE(e->timer);
-#endif
-		tbl_flush(&e->rreq_id_tbl, crit_none);
+		list_del(&e->hl);
+		FREE(e);
+	}
+
+	if (timer_pending(&rreq_fwd_timer))
+		del_timer_sync(&rreq_fwd_timer);
+
+	while ((f = (struct rreq_fwd_entry *)tbl_detach_first(&rreq_fwd_tbl))) {
+		dsr_pkt_free(f->dp);
+		FREE(f);
 	}
 #ifdef __KERNEL__
 	proc_net_remove(RREQ_TBL_PROC_NAME);
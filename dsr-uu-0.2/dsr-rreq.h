@@ -29,15 +29,34 @@ struct dsr_rreq_opt {
 #define DSR_RREQ_TOT_LEN IP_HDR_LEN + sizeof(struct dsr_opt_hdr) + sizeof(struct dsr_rreq_opt)
 #define DSR_RREQ_ADDRS_LEN(rreq_opt) (rreq_opt->length - 6)
 
+#define RREQ_TBL_HASH_SIZE 32
+#define RREQ_FWD_TBL_MAX_LEN 64
+
+struct rreq_batch {
+	struct in_addr targets[MAX_RREQ_OPTS];
+	int len;
+	struct timeval sent;	/* When the batch goes out */
+};
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 void rreq_tbl_set_max_len(unsigned int max_len);
-int dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt);
+int dsr_rreq_opt_recv(struct dsr_pkt *dp, int idx);
+int dsr_rreq_opts_recv(struct dsr_pkt *dp);
 int rreq_tbl_route_discovery_cancel(struct in_addr dst);
 int dsr_rreq_route_discovery(struct in_addr target);
 int dsr_rreq_send(struct in_addr target, int ttl);
+int dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl);
+void rreq_batch_timeout(unsigned long data);
+int dsr_rreq_fwd(struct dsr_pkt *dp);
+int rreq_fwd_tbl_dup(struct in_addr initiator, struct in_addr target,
+		     unsigned short id);
+void rreq_fwd_tbl_timeout(unsigned long data);
 void rreq_tbl_timeout(unsigned long data);
+void __rreq_disc_add(struct rreq_tbl_entry *e);
+void __rreq_disc_del(struct rreq_tbl_entry *e);
+struct rreq_tbl_entry *__rreq_tbl_find(struct in_addr node_addr);
 struct rreq_tbl_entry *__rreq_tbl_entry_create(struct in_addr node_addr);
 struct rreq_tbl_entry *__rreq_tbl_add(struct in_addr node_addr);
 int rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
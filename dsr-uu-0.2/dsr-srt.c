@@ -21,8 +21,24 @@
 #include "link-cache.h"
 #include "neigh.h"
 #include "dsr-rrep.h"
+#include "dsr-rreq.h"
 #include "debug.h"
 
+#ifdef __KERNEL__
+static struct srt_flow srt_flow_tbl[SRT_FLOW_TBL_SIZE];
+static spinlock_t srt_flow_lock = SPIN_LOCK_UNLOCKED;
+static struct srt_tmpl srt_tmpl_tbl[SRT_TMPL_TBL_SIZE];
+static spinlock_t srt_tmpl_lock = SPIN_LOCK_UNLOCKED;
+#endif
+
+static inline unsigned int srt_hash(unsigned int h, unsigned int size)
+{
+	h ^= (h >> 16);
+	h ^= (h >> 8);
+
+	return h % size;
+}
+
 struct in_addr dsr_srt_next_hop(struct dsr_srt *srt, int sleft)
 {
 	int n = srt->laddrs / sizeof(struct in_addr);
@@ -314,11 +330,42 @@ struct dsr_srt_opt *dsr_srt_opt_add(char *buf, int len, int flags,
 	return srt_opt;
 }
 
+/* Build the IP header of a packet that gets len bytes of DSR options added.
+ * Returns the protocol of the payload or -1 on failure. */
+int NSCLASS dsr_srt_build_ip(struct dsr_pkt *dp, int len)
+{
+	int ttl, tot_len, ip_len;
+	int prot = 0;
+
+#ifdef NS2
+	if (dp->p) {
+		hdr_cmn *cmh = HDR_CMN(dp->p);
+		prot = cmh->ptype();
+	} else
+		prot = PT_NTYPE;
+
+	ip_len = IP_HDR_LEN;
+	tot_len = dp->payload_len + ip_len + len;
+	ttl = dp->nh.iph->ttl();
+#else
+	prot = dp->nh.iph->protocol;
+	ip_len = (dp->nh.iph->ihl << 2);
+	tot_len = ntohs(dp->nh.iph->tot_len) + len;
+	ttl = dp->nh.iph->ttl;
+#endif
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, ip_len, tot_len,
+				  IPPROTO_DSR, ttl);
+
+	if (!dp->nh.iph)
+		return -1;
+
+	return prot;
+}
+
 int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 {
 	char *buf;
-	int n, len, ttl, tot_len, ip_len;
-	int prot = 0;
+	int n, len, prot;
 
 	if (!dp || !dp->srt)
 		return -1;
@@ -339,26 +386,10 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 /* 		DEBUG("Could allocate memory\n"); */
 		return -1;
 	}
-#ifdef NS2
-	if (dp->p) {
-		hdr_cmn *cmh = HDR_CMN(dp->p);
-		prot = cmh->ptype();
-	} else
-		prot = PT_NTYPE;
 
-	ip_len = IP_HDR_LEN;
-	tot_len = dp->payload_len + ip_len + len;
-	ttl = dp->nh.iph->ttl();
-#else
-	prot = dp->nh.iph->protocol;
-	ip_len = (dp->nh.iph->ihl << 2);
-	tot_len = ntohs(dp->nh.iph->tot_len) + len;
-	ttl = dp->nh.iph->ttl;
-#endif
-	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, ip_len, tot_len,
-				  IPPROTO_DSR, ttl);
+	prot = dsr_srt_build_ip(dp, len);
 
-	if (!dp->nh.iph)
+	if (prot < 0)
 		return -1;
 
 	dp->dh.opth = dsr_opt_hdr_add(buf, len, prot);
@@ -384,6 +415,124 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 	return 0;
 }
 
+static inline int srt_tmpl_refreshing(struct srt_tmpl *t, struct timeval *now,
+				      usecs_t margin)
+{
+	return t->refresh.tv_sec &&
+	    timeval_diff(now, &t->refresh) < (long)margin;
+}
+
+/* Add a source route to a packet originated by this node. The options are
+ * copied from the template of the last packet sent to the same destination
+ * as long as the link cache has not changed since, otherwise the route is
+ * looked up and a new template recorded. Returns -EHOSTUNREACH if there is no
+ * route to the destination.
+ *
+ * While a route is in use, a route discovery is started in the background
+ * when the route gets within RouteRefreshMargin of expiring, so that the
+ * flow does not stall in the send buffer once it expires. */
+int NSCLASS dsr_srt_tmpl_add(struct dsr_pkt *dp)
+{
+	struct srt_tmpl *t;
+	struct timeval now, expires;
+	usecs_t margin;
+	unsigned int gen;
+	char *buf = NULL;
+	int len = 0, prot, refresh = 0;
+
+	if (!dp)
+		return -1;
+
+	gen = dsr_rtc_gen();
+	margin = ConfValToUsecs(RouteRefreshMargin);
+
+	gettime(&now);
+
+	if (dp->salvage || dp->src.s_addr != my_addr().s_addr)
+		goto lookup;
+
+#ifdef __KERNEL__
+	spin_lock_bh(&srt_tmpl_lock);
+#endif
+	t = &srt_tmpl_tbl[srt_hash(dp->dst.s_addr, SRT_TMPL_TBL_SIZE)];
+
+	/* A route close to expiry is looked up again to get the expiry time
+	 * right, unless a refresh is already under way */
+	if (t->len && t->gen == gen && t->dst.s_addr == dp->dst.s_addr &&
+	    (!margin || timeval_diff(&t->expires, &now) > (long)margin ||
+	     srt_tmpl_refreshing(t, &now, margin))) {
+		len = t->len;
+		buf = dsr_pkt_alloc_opts(dp, len);
+
+		if (buf) {
+			memcpy(buf, t->opts, len);
+			dp->nxt_hop = t->nxt_hop;
+		}
+	}
+#ifdef __KERNEL__
+	spin_unlock_bh(&srt_tmpl_lock);
+#endif
+	if (!buf)
+		goto lookup;
+
+	prot = dsr_srt_build_ip(dp, len);
+
+	if (prot < 0)
+		return -1;
+
+	dp->dh.opth->nh = prot;
+	dp->srt_opt = (struct dsr_srt_opt *)(buf + DSR_OPT_HDR_LEN);
+
+	return 0;
+
+ lookup:
+	dp->srt = dsr_rtc_find(dp->src, dp->dst);
+
+	if (!dp->srt)
+		return -EHOSTUNREACH;
+
+	if (dsr_srt_add(dp) < 0)
+		return -1;
+
+	len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(dp->srt);
+
+	if (dp->salvage || dp->src.s_addr != my_addr().s_addr ||
+	    len > (int)SRT_TMPL_MAX_LEN)
+		return 0;
+
+	if (lc_srt_expires(dp->srt, &expires) < 0)
+		return 0;
+
+#ifdef __KERNEL__
+	spin_lock_bh(&srt_tmpl_lock);
+#endif
+	t = &srt_tmpl_tbl[srt_hash(dp->dst.s_addr, SRT_TMPL_TBL_SIZE)];
+
+	if (t->dst.s_addr != dp->dst.s_addr)
+		memset(&t->refresh, 0, sizeof(struct timeval));
+
+	t->dst = dp->dst;
+	t->nxt_hop = dp->nxt_hop;
+	t->gen = gen;
+	t->len = len;
+	t->expires = expires;
+	memcpy(t->opts, dp->dh.raw, len);
+
+	if (margin && timeval_diff(&expires, &now) <= (long)margin &&
+	    !srt_tmpl_refreshing(t, &now, margin)) {
+		t->refresh = now;
+		refresh = 1;
+	}
+#ifdef __KERNEL__
+	spin_unlock_bh(&srt_tmpl_lock);
+#endif
+	if (refresh) {
+		DEBUG("Refreshing route to %s\n", print_ip(dp->dst));
+		dsr_rreq_route_discovery(dp->dst);
+	}
+	return 0;
+}
+
 int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 {
 	struct in_addr next_hop_intended;
@@ -421,7 +570,8 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 	neigh_tbl_add(dp->prv_hop, dp->mac.ethh);
 
 	lc_link_add(my_addr(), dp->prv_hop,
-		    ConfValToUsecs(RouteCacheTimeout), 0, 1);
+		    ConfValToUsecs(RouteCacheTimeout), 0,
+		    neigh_tbl_link_cost(dp->prv_hop));
 
 	dsr_rtc_add(dp->srt, ConfValToUsecs(RouteCacheTimeout), 0);
 
@@ -482,3 +632,93 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 
 	return DSR_PKT_FORWARD;
 }
+
+/* Fast path for relaying packets that carry nothing but a source route and
+ * possibly an ACK request. Returns DSR_PKT_FORWARD if the packet is ready to
+ * be sent to dp->nxt_hop, or DSR_PKT_NONE if it needs full option
+ * processing. */
+int NSCLASS dsr_srt_opt_fwd(struct dsr_pkt *dp)
+{
+	struct dsr_srt_opt *srt_opt;
+	struct srt_flow *f;
+	struct in_addr myaddr;
+	struct timeval now;
+	int n, sleft, learn = 0;
+
+	if (!dp || !dp->srt_opt || (dp->flags & PKT_PROMISC_RECV) ||
+	    dp->num_rreq_opts || dp->num_rrep_opts || dp->num_rerr_opts ||
+	    dp->num_ack_opts)
+		return DSR_PKT_NONE;
+
+	myaddr = my_addr();
+
+	if (dp->dst.s_addr == myaddr.s_addr)
+		return DSR_PKT_NONE;
+
+	srt_opt = dp->srt_opt;
+	sleft = srt_opt->sleft;
+	n = (srt_opt->length - 2) / sizeof(struct in_addr);
+
+	/* Only the intended next hop takes the fast path. Route shortening
+	 * and bad segments left are handled by dsr_srt_opt_recv() */
+	if (sleft < 1 || sleft > n ||
+	    srt_opt->addrs[n - sleft] != myaddr.s_addr)
+		return DSR_PKT_NONE;
+
+	if (sleft == n)
+		dp->prv_hop = dp->src;
+	else
+		dp->prv_hop.s_addr = srt_opt->addrs[n - sleft - 1];
+
+	if (sleft == 1)
+		dp->nxt_hop = dp->dst;
+	else
+		dp->nxt_hop.s_addr = srt_opt->addrs[n - sleft + 1];
+
+	dp->salvage = srt_opt->salv;
+
+	gettime(&now);
+
+#ifdef __KERNEL__
+	spin_lock_bh(&srt_flow_lock);
+#endif
+	f = &srt_flow_tbl[srt_hash(dp->src.s_addr ^ dp->dst.s_addr,
+				     SRT_FLOW_TBL_SIZE)];
+
+	if (f->src.s_addr != dp->src.s_addr ||
+	    f->dst.s_addr != dp->dst.s_addr ||
+	    timeval_diff(&now, &f->learned) >=
+	    (long)ConfValToUsecs(RouteLearnInterval)) {
+		f->src = dp->src;
+		f->dst = dp->dst;
+		f->learned = now;
+		learn = 1;
+	}
+#ifdef __KERNEL__
+	spin_unlock_bh(&srt_flow_lock);
+#endif
+
+	if (learn) {
+		struct dsr_srt *srt;
+
+		neigh_tbl_add(dp->prv_hop, dp->mac.ethh);
+
+		lc_link_add(myaddr, dp->prv_hop,
+			    ConfValToUsecs(RouteCacheTimeout), 0,
+			    neigh_tbl_link_cost(dp->prv_hop));
+
+		srt = dsr_srt_new(dp->src, dp->dst, n * sizeof(struct in_addr),
+				  (char *)srt_opt->addrs);
+		if (srt) {
+			dsr_rtc_add(srt, ConfValToUsecs(RouteCacheTimeout), 0);
+			FREE(srt);
+		}
+	}
+
+	srt_opt->sleft--;
+
+	if (dp->ack_req_opt)
+		dsr_ack_req_opt_recv(dp, dp->ack_req_opt);
+
+	return DSR_PKT_FORWARD;
+}
@@ -92,12 +92,43 @@ void dsr_srt_del(struct dsr_srt *srt);
 struct dsr_srt *dsr_srt_concatenate(struct dsr_srt *srt1, struct dsr_srt *srt2);int dsr_srt_check_duplicate(struct dsr_srt *srt);
 struct dsr_srt *dsr_srt_new_split(struct dsr_srt *srt, struct in_addr addr);
 
+/* Flows seen on the forwarding fast path. Used to rate limit route cache
+ * learning to once every RouteLearnInterval per flow. */
+#define SRT_FLOW_TBL_SIZE 64
+
+struct srt_flow {
+	struct in_addr src;
+	struct in_addr dst;
+	struct timeval learned;
+};
+
+/* Wire format of the DSR options header and source route option last sent
+ * to a destination. Valid as long as the link cache generation is the one it
+ * was built for. */
+#define SRT_TMPL_TBL_SIZE 16
+#define SRT_TMPL_MAX_ADDRS 16
+#define SRT_TMPL_MAX_LEN (DSR_OPT_HDR_LEN + DSR_SRT_HDR_LEN + \
+			  SRT_TMPL_MAX_ADDRS * sizeof(struct in_addr))
+
+struct srt_tmpl {
+	struct in_addr dst;
+	struct in_addr nxt_hop;
+	unsigned int gen;
+	unsigned int len;	/* Zero if the entry is unused */
+	struct timeval expires;	/* When the first link of the route expires */
+	struct timeval refresh;	/* When a refresh was last started */
+	char opts[SRT_TMPL_MAX_LEN];
+};
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 
+int dsr_srt_build_ip(struct dsr_pkt *dp, int len);
 int dsr_srt_add(struct dsr_pkt *dp);
+int dsr_srt_tmpl_add(struct dsr_pkt *dp);
 int dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt);
+int dsr_srt_opt_fwd(struct dsr_pkt *dp);
 
 #endif				/* NO_DECLS */
 
@@ -68,6 +68,23 @@ enum confval {
 	PassiveAckTimeout,
 	GratReplyHoldOff,
 	MAX_SALVAGE_COUNT,
+	RouteLearnInterval,
+	SendBufferBytes,
+	SendBufferDstSize,
+	RREQSuppressCount,
+	RREQBatchWindow,
+	RouteRefreshMargin,
+	UseSelectiveAck,
+	AckCoalesceTime,
+	AckPiggyback,
+	MaintMinRTO,
+	NeighborTableSize,
+	NeighborTimeout,
+	ProbeInterval,
+	UseLinkLayerFeedback,
+	LinkTxFailed,
+	MaintHoldoffMin,
+	MaintHoldoffMax,
 	CONFVAL_MAX,
 };
 
@@ -85,7 +102,9 @@ enum confval_type {
 #define MAINT_BUF_MAX_LEN 100
 #define RREQ_TBL_MAX_LEN 64	/* Should be enough */
 #define SEND_BUF_MAX_LEN 100
+#define SEND_BUF_MAX_BYTES (SEND_BUF_MAX_LEN * 1500)
 #define RREQ_TLB_MAX_ID 16
+#define NEIGH_TBL_MAX_LEN 256
 
 static struct {
 	const char *name;
@@ -116,7 +135,24 @@ static struct {
 	"TryPassiveAcks", 1, QUANTA}, {
 	"PassiveAckTimeout", 100, MILLISECONDS}, {
 	"GratReplyHoldOff", 1, SECONDS}, {
-	"MAX_SALVAGE_COUNT", 15, QUANTA}
+	"MAX_SALVAGE_COUNT", 15, QUANTA}, {
+	"RouteLearnInterval", 1000, MILLISECONDS}, {
+	"SendBufferBytes", SEND_BUF_MAX_BYTES, QUANTA}, {
+	"SendBufferDstSize", SEND_BUF_MAX_LEN / 2, QUANTA}, {
+	"RREQSuppressCount", 0, QUANTA}, {
+	"RREQBatchWindow", 0, MILLISECONDS}, {
+	"RouteRefreshMargin", 5, SECONDS}, {
+	"UseSelectiveAck", 0, BINARY}, {
+	"AckCoalesceTime", 10, MILLISECONDS}, {
+	"AckPiggyback", 0, BINARY}, {
+	"MaintMinRTO", 5, MILLISECONDS}, {
+	"NeighborTableSize", NEIGH_TBL_MAX_LEN, QUANTA}, {
+	"NeighborTimeout", 60, SECONDS}, {
+	"ProbeInterval", 0, MILLISECONDS}, {
+	"UseLinkLayerFeedback", 0, BINARY}, {
+	"LinkTxFailed", 0, COMMAND}, {
+	"MaintHoldoffMin", 20, MILLISECONDS}, {
+	"MaintHoldoffMax", 1000, MILLISECONDS}
 };
 
 struct dsr_node {
@@ -82,6 +82,8 @@ static int lc_print(struct lc_graph *LC, char *buf);
 
 static inline void __lc_link_del(struct lc_graph *lc, struct lc_link *link)
 {																		//删除连接表（参数一）中的连接（参数二）
+	lc->gen++;
+
 	/* Also free the nodes if they lack other links */
 	if (--link->src->links == 0)
 		__tbl_del(&lc->nodes, &link->src->l);
@@ -247,6 +249,7 @@ static inline struct lc_link *__lc_link_find(struct tbl *t, struct in_addr src,
 	return (struct lc_link *)__tbl_find(t, &q, crit_link_query);
 }
 
+/* Returns 1 if the link is new or its cost or status changed */
 static int __lc_link_tbl_add(struct tbl *t, struct lc_node *src,
 			     struct lc_node *dst, usecs_t timeout, 						// 将给定连接信息加入图中
 			     int status, int cost)
@@ -276,7 +279,9 @@ static int __lc_link_tbl_add(struct tbl *t, struct lc_node *src,
 		dst->links++;
 
 		res = 1;
-	} else
+	} else if (link->status != status || link->cost != (unsigned int)cost)
+		res = 1;
+	else
 		res = 0;
 
 	link->status = status;
@@ -323,7 +328,8 @@ int NSCLASS lc_link_add(struct in_addr src, struct in_addr dst,
 
 	res = __lc_link_tbl_add(&LC.links, sn, dn, timeout, status, cost);
 
-	if (res) {
+	if (res > 0) {
+		LC.gen++;
 #ifdef LC_TIMER
 #ifdef NS2
 		if (!timer_pending(&lc_timer))
@@ -444,6 +450,43 @@ void NSCLASS __dijkstra(struct in_addr src)
 	LC.src = src_node;
 }
 
+/* Get the time when the first link of a source route expires. Returns -1 if
+ * a link of the route is not in the cache. */
+int NSCLASS lc_srt_expires(struct dsr_srt *srt, struct timeval *expires)
+{
+	struct in_addr prev, next;
+	int i, n, res = 0;
+
+	if (!srt || !expires)
+		return -1;
+
+	n = srt->laddrs / sizeof(struct in_addr);
+	prev = srt->src;
+
+	DSR_READ_LOCK(&LC.lock);
+
+	for (i = 0; i <= n; i++) {
+		struct lc_link *l;
+
+		next = (i == n) ? srt->dst : srt->addrs[i];
+
+		l = __lc_link_find(&LC.links, prev, next);
+
+		if (!l) {
+			res = -1;
+			break;
+		}
+
+		if (i == 0 || timeval_diff(&l->expires, expires) < 0)
+			*expires = l->expires;
+
+		prev = next;
+	}
+	DSR_READ_UNLOCK(&LC.lock);
+
+	return res;
+}
+
 struct dsr_srt *NSCLASS lc_srt_find(struct in_addr src, struct in_addr dst)
 {
 	struct dsr_srt *srt = NULL;
@@ -549,22 +592,22 @@ lc_srt_add(struct dsr_srt *srt, usecs_t timeout, unsigned short flags)
 	for (i = 0; i < n; i++) {
 		addr2 = srt->addrs[i];
 
-		lc_link_add(addr1, addr2, timeout, 0, 1);
+		lc_link_add(addr1, addr2, timeout, 0, LC_COST_HOP);
 		links++;
 
 		if (srt->flags & SRT_BIDIR) {
-			lc_link_add(addr2, addr1, timeout, 0, 1);
+			lc_link_add(addr2, addr1, timeout, 0, LC_COST_HOP);
 			links++;
 		}
 		addr1 = addr2;
 	}
 	addr2 = srt->dst;
 
-	lc_link_add(addr1, addr2, timeout, 0, 1);
+	lc_link_add(addr1, addr2, timeout, 0, LC_COST_HOP);
 	links++;
 
 	if (srt->flags & SRT_BIDIR) {
-		lc_link_add(addr2, addr1, timeout, 0, 1);
+		lc_link_add(addr2, addr1, timeout, 0, LC_COST_HOP);
 		links++;
 	}
 	return links;
@@ -591,10 +634,16 @@ void NSCLASS lc_flush(void)
 	tbl_flush(&LC.nodes, NULL);
 
 	LC.src = NULL;
+	LC.gen++;
 
 	DSR_WRITE_UNLOCK(&LC.lock);
 }
 
+unsigned int NSCLASS lc_gen(void)
+{
+	return LC.gen;
+}
+
 #ifdef __KERNEL__
 static char *print_hops(unsigned int hops)
 {
@@ -684,6 +733,8 @@ EXPORT_SYMBOL(lc_srt_find);
 EXPORT_SYMBOL(lc_flush);
 EXPORT_SYMBOL(lc_link_del);
 EXPORT_SYMBOL(lc_link_add);
+EXPORT_SYMBOL(lc_gen);
+EXPORT_SYMBOL(lc_srt_expires);
 
 module_init(lc_init);
 module_exit(lc_cleanup);
@@ -697,6 +748,7 @@ int __init NSCLASS lc_init(void)
 	INIT_TBL(&LC.nodes, LC_NODES_MAX);
 
 	LC.src = NULL;
+	LC.gen = 0;
 
 #ifdef __KERNEL__
 	LC.lock = RW_LOCK_UNLOCKED;
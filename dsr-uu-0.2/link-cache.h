@@ -19,14 +19,20 @@ struct lc_graph {
 	struct tbl nodes;
 	struct tbl links;
 	struct lc_node *src;
+	unsigned int gen;	/* Bumped whenever routes may have changed */
 #ifdef __KERNEL__
 	struct timer_list timer;
 	rwlock_t lock;
 #endif
 };
 
+/* Cost of a loss free link. Link costs are expected transmission counts
+ * in units of 1/LC_COST_HOP. */
+#define LC_COST_HOP 16
+
 #define dsr_rtc_find(s,d) lc_srt_find(s,d)
 #define dsr_rtc_add(srt,t,f) lc_srt_add(srt,t,f)
+#define dsr_rtc_gen() lc_gen()
 
 #endif				/* NO_GLOBALS */
 
@@ -38,9 +44,11 @@ int lc_link_add(struct in_addr src, struct in_addr dst,
 void lc_garbage_collect_set(void);
 void lc_garbage_collect(unsigned long data);
 struct dsr_srt *lc_srt_find(struct in_addr src, struct in_addr dst);
+int lc_srt_expires(struct dsr_srt *srt, struct timeval *expires);
 int lc_srt_add(struct dsr_srt *srt, unsigned long timeout,
 	       unsigned short flags);
 void lc_flush(void);
+unsigned int lc_gen(void);
 void __dijkstra(struct in_addr src);
 int lc_init(void);
 void lc_cleanup(void);
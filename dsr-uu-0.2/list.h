@@ -84,6 +84,9 @@ static inline int list_detach(list_t * le)
 
 #define list_first(head) ((head)->next)
 
+#define list_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
+
 #define list_unattached(le) ((le)->next == NULL && (le)->prev == NULL)
 
 #define list_del(le) list_detach(le)
@@ -29,132 +29,214 @@
 
 #define MAINT_BUF_PROC_FS_NAME "maint_buf"
 
+/* All buffered packets in the order they were sent. Each packet is also
+ * queued on its next hop's queue in maint_buf_qtbl and indexed on expiry
+ * time in maint_heap. All are protected by the maint_buf lock. */
 TBL(maint_buf, MAINT_BUF_MAX_LEN);
+static list_t maint_buf_qtbl[MAINT_BUF_HASH_SIZE];
+static struct maint_heap maint_heap;
 
 static DSRUUTimer ack_timer;
 
 #endif				/* NS2 */
 
-struct maint_entry {
-	list_t l;
-	struct in_addr nxt_hop;
-	unsigned int rexmt;
-	unsigned short id;
-	struct timeval tx_time, expires;
-	usecs_t rto;
-	int ack_req_sent;
-	struct dsr_pkt *dp;
-};
-
-struct maint_buf_query {
-	struct in_addr *nxt_hop;
-	unsigned short *id;
-	usecs_t rtt;
-};
-
 #ifdef __KERNEL__
 static int maint_buf_print(struct tbl *t, char *buffer);
 #endif
 
-/* Criteria function for deleting packets from buffer based on next hop and
- * id */
-/*
-	һIDӻɾı׼
-*/
-static inline int crit_addr_id_del(void *pos, void *data)
+static inline unsigned int maint_buf_hash(struct in_addr nxt_hop)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_buf_query *q = (struct maint_buf_query *)data;
+	return (nxt_hop.s_addr ^ (nxt_hop.s_addr >> 16)) % MAINT_BUF_HASH_SIZE;
+}
 
-	if (m->nxt_hop.s_addr == q->nxt_hop->s_addr && m->id <= *(q->id)) {
-		struct timeval now;
-		
-		gettime(&now);
-		
-		/* Only update RTO if this was not a retransmission */
-		if (m->id == *(q->id) && m->rexmt == 0)
-			q->rtt = timeval_diff(&now, &m->tx_time);
+static struct maint_queue *__maint_queue_find(list_t *bucket,
+					      struct in_addr nxt_hop)
+{
+	list_t *pos;
 
-		if (m->dp) {
-#ifdef NS2
-			if (m->dp->p)
-				Packet::free(m->dp->p);
-#endif
-			dsr_pkt_free(m->dp);
-			return 1;
-		}	
+	list_for_each(pos, bucket) {
+		struct maint_queue *q = (struct maint_queue *)pos;
+
+		if (q->nxt_hop.s_addr == nxt_hop.s_addr)
+			return q;
 	}
-	return 0;
+	return NULL;
 }
 
-/* Criteria function for deleting packets from buffer based on next hop */
-/* ڻһӻɾı׼ */
-static inline int crit_addr_del(void *pos, void *data)
+static inline int maint_entry_before(struct maint_entry *a,
+				     struct maint_entry *b)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_buf_query *q = (struct maint_buf_query *)data;
+	return timeval_diff(&a->expires, &b->expires) < 0;
+}
 
-	if (m->nxt_hop.s_addr == q->nxt_hop->s_addr) {
-		struct timeval now;
-		
-		gettime(&now);
-		
-		if (m->rexmt == 0)
-			q->rtt = timeval_diff(&now, &m->tx_time);
-		
-		if (m->dp) {
-#ifdef NS2
-			if (m->dp->p)
-				Packet::free(m->dp->p);
-#endif
-			dsr_pkt_free(m->dp);
-			return 1;
-		}
+static inline void maint_heap_swap(struct maint_heap *h, unsigned int i,
+				   unsigned int j)
+{
+	struct maint_entry *m = h->e[i];
+
+	h->e[i] = h->e[j];
+	h->e[j] = m;
+	h->e[i]->hidx = i;
+	h->e[j]->hidx = j;
+}
+
+static void maint_heap_up(struct maint_heap *h, unsigned int i)
+{
+	while (i > 0 && maint_entry_before(h->e[i], h->e[(i - 1) / 2])) {
+		maint_heap_swap(h, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
-	return 0;
 }
 
+static void maint_heap_down(struct maint_heap *h, unsigned int i)
+{
+	unsigned int c;
+
+	while ((c = 2 * i + 1) < h->len) {
+		if (c + 1 < h->len && maint_entry_before(h->e[c + 1], h->e[c]))
+			c++;
+
+		if (!maint_entry_before(h->e[c], h->e[i]))
+			break;
+
+		maint_heap_swap(h, i, c);
+		i = c;
+	}
+}
 
-/* Criteria function for buffered packets based on next hop */
-/* һĻ׼ */
-static inline int crit_addr(void *pos, void *data)
+static int maint_heap_add(struct maint_heap *h, struct maint_entry *m)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct in_addr *nxt_hop = (struct in_addr *)data;
+	if (h->len >= MAINT_BUF_MAX_LEN)
+		return -1;
 
-	if (m->nxt_hop.s_addr == nxt_hop->s_addr)
-		return 1;
+	m->hidx = h->len;
+	h->e[h->len++] = m;
+	maint_heap_up(h, m->hidx);
 
 	return 0;
 }
 
-/* Criteria function for buffered packets based on expire time */
-//ڳʱĻ׼
-static inline int crit_expires(void *pos, void *data)
+static void maint_heap_del(struct maint_heap *h, struct maint_entry *m)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_entry *m_new = (struct maint_entry *)data;
+	unsigned int i = m->hidx;
 
-	if (timeval_diff(&m->expires, &m_new->expires) > 0)
-		return 1;
-	return 0;
+	if (--h->len == i)
+		return;
 
+	h->e[i] = h->e[h->len];
+	h->e[i]->hidx = i;
+
+	if (i > 0 && maint_entry_before(h->e[i], h->e[(i - 1) / 2]))
+		maint_heap_up(h, i);
+	else
+		maint_heap_down(h, i);
 }
 
-/* Criteria function for buffered packets based on sent ACK REQ */
-//ڷACK  request׼
-static inline int crit_ack_req_sent(void *pos, void *data)
+/* Add a packet to the buffer, its next hop's queue and the deadline heap.
+ * Packets are sent with increasing ACK ids, so adding to the tail keeps the
+ * queue in id order. */
+int NSCLASS __maint_buf_add(struct maint_entry *m)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
+	list_t *bucket = &maint_buf_qtbl[maint_buf_hash(m->nxt_hop)];
+	struct maint_queue *q;
+
+	q = __maint_queue_find(bucket, m->nxt_hop);
+
+	if (!q) {
+		q = (struct maint_queue *)MALLOC(sizeof(*q), GFP_ATOMIC);
+
+		if (!q)
+			return -1;
+
+		INIT_LIST(&q->pkts);
+		q->nxt_hop = m->nxt_hop;
+		q->len = 0;
+		list_add(&q->l, bucket);
+	}
+
+	if (__tbl_add_tail(&maint_buf, &m->l) < 0) {
+		if (q->len == 0) {
+			list_del(&q->l);
+			FREE(q);
+		}
+		return -1;
+	}
+	list_add_tail(&m->ql, &q->pkts);
+	q->len++;
+	m->q = q;
+
+	maint_heap_add(&maint_heap, m);
 
-	if (m->ack_req_sent)
-		return 1;
 	return 0;
 }
 
-// û󳤶
+/* Remove a packet from the buffer, its queue and the deadline heap */
+void NSCLASS __maint_buf_detach(struct maint_entry *m)
+{
+	struct maint_queue *q = m->q;
+
+	__tbl_detach(&maint_buf, &m->l);
+	maint_heap_del(&maint_heap, m);
+
+	list_del(&m->ql);
+
+	if (--q->len == 0) {
+		list_del(&q->l);
+		FREE(q);
+	}
+}
+
+/* Move all packets for a next hop to the list pkts, linked through their
+ * "l" member. Returns the number of packets. */
+int NSCLASS __maint_buf_queue_detach(struct in_addr nxt_hop, list_t *pkts)
+{
+	struct maint_queue *q;
+	int n = 0;
+
+	q = __maint_queue_find(&maint_buf_qtbl[maint_buf_hash(nxt_hop)],
+			       nxt_hop);
+
+	while (q) {
+		struct maint_entry *m;
+		int last = (q->len == 1);
+
+		m = list_entry(q->pkts.next, struct maint_entry, ql);
+
+		__maint_buf_detach(m);
+		list_add_tail(&m->l, pkts);
+		n++;
+
+		/* The queue is freed with its last packet */
+		if (last)
+			break;
+	}
+	return n;
+}
+
+static inline void maint_entries_free(list_t *pkts)
+{
+	list_t *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, pkts) {
+		struct maint_entry *m = (struct maint_entry *)pos;
+
+		if (m->dp) {
+#ifdef NS2
+			if (m->dp->p)
+				Packet::free(m->dp->p);
+#endif
+			dsr_pkt_free(m->dp);
+		}
+		FREE(m);
+	}
+}
+
 void NSCLASS maint_buf_set_max_len(unsigned int max_len)
 {
+	/* The deadline heap has room for MAINT_BUF_MAX_LEN packets */
+	if (max_len > MAINT_BUF_MAX_LEN)
+		max_len = MAINT_BUF_MAX_LEN;
+
 	maint_buf.max_len = max_len;
 }
 
@@ -178,12 +260,9 @@ static struct maint_entry *maint_entry_create(struct dsr_pkt *dp,
 	m->id = id;
 	m->rto = rto;
 	m->ack_req_sent = 0;
-#ifdef NS2
-	if (dp->p)
-		m->dp = dsr_pkt_alloc(dp->p->copy());
-#else
-	m->dp = dsr_pkt_alloc(skb_copy(dp->skb, GFP_ATOMIC));
-#endif
+	/* Only the headers are copied, the payload is shared */
+	m->dp = dsr_pkt_clone(dp);
+
 	if (!m->dp) {
 		FREE(m);
 		return NULL;
@@ -205,6 +284,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	if (dp->srt) {
 		DEBUG("old internal source route exists\n");
 		FREE(dp->srt);
+		dp->srt = NULL;
 	}
 
 	alt_srt = dsr_rtc_find(my_addr(), dp->dst);
@@ -289,56 +369,26 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	DEBUG("Salvage - source route length new=%d old=%d\n",
 	      new_srt_opt_len, old_srt_opt_len);
 
-	if (old_srt_opt_len == new_srt_opt_len) {
-		DEBUG("new and old srt of same length\n");
-		
-		dp->srt_opt = dsr_srt_opt_add((char *)dp->srt_opt, 
-					      new_srt_opt_len, 0, 
-					      salv + 1, srt);
-	} else {
-		int old_opt_len, new_opt_len;
-		char *old_opt = dp->dh.raw;
-		char *old_srt_opt = (char *)dp->srt_opt;
-		char *buf;
-		
-		DEBUG("Creating new options header\n");
-		
-		old_opt_len = dsr_pkt_opts_len(dp);
-		new_opt_len = old_opt_len - old_srt_opt_len + new_srt_opt_len;
-		
-		DEBUG("opt_len old=%d new=%d srt: %s\n", 
-		      old_opt_len, new_opt_len, print_srt(srt));
+	if (old_srt_opt_len != new_srt_opt_len) {
+		DEBUG("Resizing source route option\n");
 
-		/* Allocate new options space */
-		buf = dsr_pkt_alloc_opts(dp, new_opt_len);
-		
-		if (!buf) {
+		/* The options following the source route are moved in place
+		 * when there is room, otherwise copied once */
+		if (dsr_pkt_opts_resize(dp, (char *)dp->srt_opt,
+					old_srt_opt_len, new_srt_opt_len) < 0) {
 			FREE(srt);
 			return -1;
 		}
-				
-		/* Copy everything up to old source route option */
-		memcpy(buf, old_opt, old_srt_opt - old_opt);
-		
-		buf += (old_srt_opt - old_opt);
-		
-		/* Add new source route option */
-		dp->srt_opt = dsr_srt_opt_add(buf, new_srt_opt_len, 0, 
-					      salv + 1, srt);
-
-		buf += new_srt_opt_len;
-		
-		/* Copy everything from after old source route option and to the
-		 * end */
-		memcpy(buf, old_srt_opt + old_srt_opt_len, 
-		       old_opt + old_opt_len - 
-		       (old_srt_opt + old_srt_opt_len));
-
-		FREE(old_opt);	
-		
-		/* Set new length in DSR header */
-		dp->dh.opth->p_len = htons(new_opt_len - DSR_OPT_HDR_LEN);
+		dp->dh.opth->p_len = htons(ntohs(dp->dh.opth->p_len) +
+					   new_srt_opt_len - old_srt_opt_len);
+#ifdef __KERNEL__
+		dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+			     ntohs(dp->nh.iph->tot_len) + new_srt_opt_len - 
+			     old_srt_opt_len, IPPROTO_DSR, dp->nh.iph->ttl);
+#endif
 	}
+	dp->srt_opt = dsr_srt_opt_add((char *)dp->srt_opt, new_srt_opt_len, 0,
+				      salv + 1, srt);
 
 	/* We got this packet directly from the previous hop */
 	dp->srt_opt->sleft = sleft;
@@ -348,148 +398,242 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	DEBUG("Next hop=%s p_len=%d\n", print_ip(dp->nxt_hop), ntohs(dp->dh.opth->p_len));
 
 	dp->srt = srt;
-
+#ifdef NS2
+	/* The Packet may still be shared with the original transmission */
+	if (dp->p) {
+		Packet *p = dp->p->copy();
+		Packet::free(dp->p);
+		dp->p = p;
+	}
+#endif
 	XMIT(dp);
 	
 	return 0;
 }
 
 
-void NSCLASS maint_buf_timeout(unsigned long data)
+/* Salvage packets detached from the buffer. Those that cannot be salvaged
+ * are dropped. Returns the number salvaged. */
+int NSCLASS maint_buf_salvage_list(list_t *pkts)
 {
-	struct maint_entry *m, *m2;
+	list_t *pos, *tmp;
+	int n = 0;
 
-	if (timer_pending(&ack_timer))
-		return;
+	list_for_each_safe(pos, tmp, pkts) {
+		struct maint_entry *m = (struct maint_entry *)pos;
 
-	/* Get the first packet */
-	m = (struct maint_entry *)tbl_detach_first(&maint_buf);
-		
-	if (!m) {
-		DEBUG("Nothing in maint buf\n");
-		return;
+		if (maint_buf_salvage(m->dp) < 0) {
+#ifdef NS2
+			if (m->dp->p)
+				drop(m->dp->p, DROP_RTR_SALVAGE);
+#endif
+			dsr_pkt_free(m->dp);
+		} else
+			n++;
+		FREE(m);
 	}
-	m->rexmt++;
-
-	DEBUG("nxt_hop=%s id=%u rexmt=%d\n",
-	      print_ip(m->nxt_hop), m->id, m->rexmt);
-
-	/* Increase the number of retransmits */
-	if (m->rexmt >= ConfVal(MaxMaintRexmt)) {
+	return n;
+}
 
-		DEBUG("MaxMaintRexmt reached!\n");
+/* Give up on a packet that has not been acknowledged. If an ACK REQ was
+ * sent, the link is considered broken and the other packets for the same
+ * next hop are salvaged. */
+void NSCLASS maint_buf_expire(struct maint_entry *m)
+{
+	DEBUG("MaxMaintRexmt reached!\n");
 
-		if (m->ack_req_sent) {
-			int n = 0;
+	if (m->ack_req_sent) {
+		list_t pkts;
+		int n = 0;
 
-			lc_link_del(my_addr(), m->nxt_hop);
+		lc_link_del(my_addr(), m->nxt_hop);
 #ifdef NS2
-			/* Remove packets from interface queue */
-			Packet *qp;
-			
-			while ((qp = ifq_->prq_get_nexthop((nsaddr_t)m->nxt_hop.s_addr))) {
-				Packet::free(qp);
-			}
-#endif			
-			dsr_rerr_send(m->dp, m->nxt_hop);
+		/* Remove packets from interface queue */
+		Packet *qp;
 
-			/* Salvage timed out packet */
-			if (maint_buf_salvage(m->dp) < 0) {
-#ifdef NS2
-				if (m->dp->p) 
-					drop(m->dp->p, DROP_RTR_SALVAGE);
-#endif
-				dsr_pkt_free(m->dp);
-			} else
-				n++;
-			/* Salvage other packets in maintenance buffer with the
-			 * same next hop */
-			while ((m2 = (struct maint_entry *)tbl_find_detach(&maint_buf, &m->nxt_hop, crit_addr))) {
-				
-				if (maint_buf_salvage(m2->dp) < 0) {
-#ifdef NS2
-					if (m2->dp->p)
-						drop(m2->dp->p, DROP_RTR_SALVAGE);
+		while ((qp = ifq_->prq_get_nexthop((nsaddr_t)m->nxt_hop.s_addr))) {
+			Packet::free(qp);
+		}
 #endif
-					dsr_pkt_free(m2->dp);
-				}
-				FREE(m2);
-				n++;
-			}
-			DEBUG("Salvaged %d packets from maint_buf\n", n);
-		} else {
-			DEBUG("No ACK REQ sent for this packet\n");
+		dsr_rerr_send(m->dp, m->nxt_hop);
 
-			if (m->dp) {
+		/* Salvage timed out packet */
+		if (maint_buf_salvage(m->dp) < 0) {
 #ifdef NS2
-				if (m->dp->p)
-					drop(m->dp->p, DROP_RTR_SALVAGE);
+			if (m->dp->p)
+				drop(m->dp->p, DROP_RTR_SALVAGE);
 #endif
-				dsr_pkt_free(m->dp);
-			}			
-		}		
-		
-		FREE(m);
-		goto out;
-	}
+			dsr_pkt_free(m->dp);
+		} else
+			n++;
 
-	/* Set new Transmit time */
-	gettime(&m->tx_time);
-	m->expires = m->tx_time;
-	timeval_add_usecs(&m->expires, m->rto);
+		/* Salvage other packets in maintenance buffer with the same
+		 * next hop */
+		INIT_LIST(&pkts);
 
-	/* Send new ACK REQ */
-	if (m->ack_req_sent)
-		dsr_ack_req_send(m->nxt_hop, m->id);
+		DSR_WRITE_LOCK(&maint_buf.lock);
+		__maint_buf_queue_detach(m->nxt_hop, &pkts);
+		DSR_WRITE_UNLOCK(&maint_buf.lock);
 
-	/* Add to maintenence buffer again */
-	tbl_add(&maint_buf, &m->l, crit_expires);
-      out:
-	maint_buf_set_timeout();
+		n += maint_buf_salvage_list(&pkts);
+
+		DEBUG("Salvaged %d packets from maint_buf\n", n);
+	} else {
+		DEBUG("No ACK REQ sent for this packet\n");
 
-	return;
+		if (m->dp) {
+#ifdef NS2
+			if (m->dp->p)
+				drop(m->dp->p, DROP_RTR_SALVAGE);
+#endif
+			dsr_pkt_free(m->dp);
+		}
+	}
+	FREE(m);
 }
 
-void NSCLASS maint_buf_set_timeout(void)
+void NSCLASS maint_buf_timeout(unsigned long data)
 {
 	struct maint_entry *m;
+	struct in_addr nxt_hop;
+	unsigned short id;
+	struct timeval now;
 	usecs_t rto;
-	struct timeval tx_time, now, expires;
-
-	if (tbl_empty(&maint_buf))
-		return;
 
 	gettime(&now);
 
 	DSR_WRITE_LOCK(&maint_buf.lock);
-	/* Get first packet in maintenance buffer */
-	m = (struct maint_entry *)__tbl_find(&maint_buf, NULL,
-					     crit_ack_req_sent);
 
-	if (!m) {
-		DEBUG("No packet to set timeout for\n");
+	/* Handle every packet that is due, earliest first. The lock is dropped
+	 * while sending, so the heap is rechecked each round. */
+	while (maint_heap.len) {
+		m = maint_heap.e[0];
+
+		if (timeval_diff(&m->expires, &now) > 0)
+			break;
+
+		/* The link layer did not report a failure in time, so the
+		 * packet got through */
+		if (m->dp->flags & PKT_LL_FEEDBACK) {
+			__maint_buf_detach(m);
+			DSR_WRITE_UNLOCK(&maint_buf.lock);
+#ifdef NS2
+			if (m->dp->p)
+				Packet::free(m->dp->p);
+#endif
+			dsr_pkt_free(m->dp);
+			FREE(m);
+			DSR_WRITE_LOCK(&maint_buf.lock);
+			continue;
+		}
+
+		/* No passive ACK was heard, ask for an explicit one */
+		if (m->dp->flags & PKT_PASSIVE_ACK) {
+			struct neighbor_info neigh_info;
+
+			m->dp->flags &= ~PKT_PASSIVE_ACK;
+			m->ack_req_sent = 1;
+
+			/* The ACK REQ gets a fresh id, like one sent in band,
+			 * so that its ACK does not cover later packets. With
+			 * the new id the packet goes last in id order. */
+			if (neigh_tbl_query(m->nxt_hop, &neigh_info)) {
+				m->id = neigh_info.id;
+				neigh_tbl_id_inc(m->nxt_hop);
+
+				list_del(&m->ql);
+				list_add_tail(&m->ql, &m->q->pkts);
+			}
+			m->tx_time = now;
+			m->expires = now;
+			timeval_add_usecs(&m->expires, m->rto);
+
+			maint_heap_del(&maint_heap, m);
+			maint_heap_add(&maint_heap, m);
+
+			nxt_hop = m->nxt_hop;
+			id = m->id;
+
+			DEBUG("No passive ACK from %s, sending ACK REQ id=%u\n",
+			      print_ip(nxt_hop), id);
+
+			DSR_WRITE_UNLOCK(&maint_buf.lock);
+			neigh_tbl_set_ack_req_time(nxt_hop);
+			dsr_ack_req_send(nxt_hop, id);
+			DSR_WRITE_LOCK(&maint_buf.lock);
+			continue;
+		}
+
+		/* Increase the number of retransmits */
+		m->rexmt++;
+
+		DEBUG("nxt_hop=%s id=%u rexmt=%d\n",
+		      print_ip(m->nxt_hop), m->id, m->rexmt);
+
+		if (m->rexmt >= ConfVal(MaxMaintRexmt)) {
+			__maint_buf_detach(m);
+
+			DSR_WRITE_UNLOCK(&maint_buf.lock);
+			maint_buf_expire(m);
+			DSR_WRITE_LOCK(&maint_buf.lock);
+			continue;
+		}
+
+		/* Exponential backoff, which also holds for later packets to
+		 * the neighbor until there is a new RTT sample. Only an ACK
+		 * REQ that timed out is evidence of loss, held off packets
+		 * are just rearmed. */
+		if (m->ack_req_sent) {
+			rto = neigh_tbl_rto_backoff(m->nxt_hop, m->rexmt);
+
+			if (rto)
+				m->rto = rto;
+		}
+
+		/* Set new Transmit time */
+		m->tx_time = now;
+		m->expires = now;
+		timeval_add_usecs(&m->expires, m->rto);
+
+		maint_heap_del(&maint_heap, m);
+		maint_heap_add(&maint_heap, m);
+
+		if (!m->ack_req_sent)
+			continue;
+
+		nxt_hop = m->nxt_hop;
+		id = m->id;
+
+		/* Send new ACK REQ */
 		DSR_WRITE_UNLOCK(&maint_buf.lock);
-		return;
+		dsr_ack_req_send(nxt_hop, id);
+		DSR_WRITE_LOCK(&maint_buf.lock);
 	}
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
 
-	tx_time = m->tx_time;
-	rto = m->rto;
-	m->expires = tx_time;
-	timeval_add_usecs(&m->expires, m->rto);
+	maint_buf_set_timeout();
+}
 
-	expires = m->expires;
+/* Arm the ACK timer for the earliest deadline in the heap */
+void NSCLASS maint_buf_set_timeout(void)
+{
+	struct timeval expires;
+	int rearm = 0;
 
-	DSR_WRITE_UNLOCK(&maint_buf.lock);
+	DSR_READ_LOCK(&maint_buf.lock);
 
-	/* Check if this packet has already expired */
-	if (timeval_diff(&now, &tx_time) > (int)rto)
-		maint_buf_timeout(0);
-	else {
-		DEBUG("ACK Timer: exp=%ld.%06ld now=%ld.%06ld\n",
-		      expires.tv_sec, expires.tv_usec, now.tv_sec, now.tv_usec);
-/* 		ack_timer.data = (unsigned long)m; */
-		set_timer(&ack_timer, &expires);
+	if (maint_heap.len) {
+		expires = maint_heap.e[0]->expires;
+		rearm = 1;
 	}
+	DSR_READ_UNLOCK(&maint_buf.lock);
+
+	if (rearm) {
+		DEBUG("ACK Timer: exp=%ld.%06ld\n",
+		      expires.tv_sec, expires.tv_usec);
+		set_timer(&ack_timer, &expires);
+	} else if (timer_pending(&ack_timer))
+		del_timer(&ack_timer);
 }
 
 int NSCLASS maint_buf_add(struct dsr_pkt *dp)
@@ -504,6 +648,9 @@ int NSCLASS maint_buf_add(struct dsr_pkt *dp)
 		return -1;
 	}
 
+	if (!(dp->flags & PKT_REQUEST_ACK))
+		return 0;
+
 	gettime(&now);
 
 	res = neigh_tbl_query(dp->nxt_hop, &neigh_info);
@@ -518,80 +665,168 @@ int NSCLASS maint_buf_add(struct dsr_pkt *dp)
 	if (!m)
 		return -1;
 	
-	/* Check if we should add an ACK REQ */
-	if (dp->flags & PKT_REQUEST_ACK) {
-		if ((usecs_t) timeval_diff(&now, &neigh_info.last_ack_req) > 
-		    ConfValToUsecs(MaintHoldoffTime)) {
-			m->ack_req_sent = 1;
-			
-			/* Set last_ack_req time */
-			neigh_tbl_set_ack_req_time(m->nxt_hop);
-		
-			neigh_tbl_id_inc(m->nxt_hop);	
-			
-			dsr_ack_req_opt_add(dp, m->id);
-		}
-		
-		if (tbl_add_tail(&maint_buf, &m->l) < 0) {
-			DEBUG("Buffer full - not buffering!\n");
-			dsr_pkt_free(m->dp);
-			FREE(m);
-			return -1;
-		}
-		
-		maint_buf_set_timeout();
-	       
+	/* With link layer feedback the packet is kept only for salvaging,
+	 * should the link layer report a failure. If the next hop is to
+	 * forward the packet, hearing it do so is acknowledgement enough.
+	 * Otherwise check if we should add an ACK REQ */
+	if (ConfVal(UseLinkLayerFeedback)) {
+		m->dp->flags |= PKT_LL_FEEDBACK;
+	} else if (ConfVal(TryPassiveAcks) && dp->srt_opt &&
+		   dp->srt_opt->sleft > 0) {
+		m->dp->flags |= PKT_PASSIVE_ACK;
+		m->expires = m->tx_time;
+		timeval_add_usecs(&m->expires,
+				  ConfValToUsecs(PassiveAckTimeout));
+
+		DEBUG("Waiting for passive ACK from %s\n",
+		      print_ip(dp->nxt_hop));
+	} else if ((usecs_t) timeval_diff(&now, &neigh_info.last_ack_req) >
+		   neigh_info.holdoff) {
+		m->ack_req_sent = 1;
+
+		/* Set last_ack_req time */
+		neigh_tbl_set_ack_req_time(m->nxt_hop);
+
+		neigh_tbl_id_inc(m->nxt_hop);
+
+		dsr_ack_req_opt_add(dp, m->id);
 	} else {
 		DEBUG("Delaying ACK REQ for %s since_last=%ld limit=%ld\n",
-		      print_ip(dp->nxt_hop), 
-		      timeval_diff(&now, &neigh_info.last_ack_req), 
-		      ConfValToUsecs(MaintHoldoffTime));
+		      print_ip(dp->nxt_hop),
+		      timeval_diff(&now, &neigh_info.last_ack_req),
+		      neigh_info.holdoff);
 	}
-	
+
+	DSR_WRITE_LOCK(&maint_buf.lock);
+	res = __maint_buf_add(m);
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	if (res < 0) {
+		DEBUG("Buffer full - not buffering!\n");
+		dsr_pkt_free(m->dp);
+		FREE(m);
+		return -1;
+	}
+
+	maint_buf_set_timeout();
+
 	return 1;
 }
 
+/* The link layer could not deliver to a next hop. Instead of waiting for
+ * ACK timeouts, the link is removed and the packets buffered for the next
+ * hop are salvaged at once. */
+int NSCLASS maint_buf_link_failed(struct in_addr nxt_hop)
+{
+	list_t pkts;
+	int n;
+
+	DEBUG("Link layer failure to %s\n", print_ip(nxt_hop));
+
+	lc_link_del(my_addr(), nxt_hop);
+
+	INIT_LIST(&pkts);
+
+	DSR_WRITE_LOCK(&maint_buf.lock);
+	__maint_buf_queue_detach(nxt_hop, &pkts);
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	/* The oldest packet is the one most likely to have failed */
+	if (!list_empty(&pkts))
+		dsr_rerr_send(((struct maint_entry *)list_first(&pkts))->dp,
+			      nxt_hop);
+
+	n = maint_buf_salvage_list(&pkts);
+
+	DEBUG("Salvaged %d packets from maint_buf\n", n);
+
+	maint_buf_set_timeout();
+
+	return n;
+}
+
 /* Remove all packets for a next hop */
 int NSCLASS maint_buf_del_all(struct in_addr nxt_hop)
 {
-	struct maint_buf_query q;
+	list_t pkts;
 	int n;
 
-	q.id = NULL;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
+	INIT_LIST(&pkts);
 
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
+	DSR_WRITE_LOCK(&maint_buf.lock);
+	n = __maint_buf_queue_detach(nxt_hop, &pkts);
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
 
-	n = tbl_for_each_del(&maint_buf, &q, crit_addr_del);
+	maint_entries_free(&pkts);
 
 	maint_buf_set_timeout();
 
 	return n;
 }
 
-/* Remove packets for a next hop with a specific ID */
+/* Remove packets for a next hop with an ID up to and including id */
 int NSCLASS maint_buf_del_all_id(struct in_addr nxt_hop, unsigned short id)
 {
-	struct maint_buf_query q;
-	int n;
+	return maint_buf_del_sack(nxt_hop, id, 0);
+}
 
-	q.id = &id;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
+/* Remove packets for a next hop with an ID up to and including id, and
+ * those with an id + n for which bit n is set in bitmap. Only the queue of
+ * that next hop is looked at, and since it is in id order the walk stops at
+ * the first packet beyond the bitmap. */
+int NSCLASS maint_buf_del_sack(struct in_addr nxt_hop, unsigned short id,
+			       u_int32_t bitmap)
+{
+	struct maint_queue *q;
+	struct timeval now;
+	list_t pkts, *pos;
+	usecs_t rtt = 0;
+	unsigned int left;
+	int n = 0;
 
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
+	INIT_LIST(&pkts);
 
-	/* Find the buffered packet to mark as acked */
-	n = tbl_for_each_del(&maint_buf, &q, crit_addr_id_del);
-	
-	if (q.rtt > 0) {
+	gettime(&now);
+
+	DSR_WRITE_LOCK(&maint_buf.lock);
+
+	q = __maint_queue_find(&maint_buf_qtbl[maint_buf_hash(nxt_hop)],
+			       nxt_hop);
+
+	/* The queue is freed with its last packet, so count down instead of
+	 * looking at it again */
+	left = q ? q->len : 0;
+	pos = q ? q->pkts.next : NULL;
+
+	while (left--) {
+		struct maint_entry *m = list_entry(pos, struct maint_entry, ql);
+		short d = (short)(m->id - id);
+
+		pos = pos->next;
+
+		if (d >= DSR_SACK_BITS)
+			break;
+
+		if (d > 0 && !(bitmap & (1U << d)))
+			continue;
+
+		/* Only update RTO if this was not a retransmission */
+		if (d >= 0 && m->rexmt == 0)
+			rtt = timeval_diff(&now, &m->tx_time);
+
+		__maint_buf_detach(m);
+		list_add_tail(&m->l, &pkts);
+		n++;
+	}
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	maint_entries_free(&pkts);
+
+	if (rtt > 0) {
 		struct neighbor_info neigh_info;
 		
 		neigh_info.id = id;
-		neigh_info.rtt = q.rtt;
+		neigh_info.rtt = rtt;
 		neigh_tbl_set_rto(nxt_hop, &neigh_info);
 	}
 
@@ -599,26 +834,118 @@ int NSCLASS maint_buf_del_all_id(struct in_addr nxt_hop, unsigned short id)
 
 	return n;
 }
+
+static inline int maint_entry_match(struct maint_entry *m,
+				    struct dsr_pkt *dp)
+{
+	if (m->dp->src.s_addr != dp->src.s_addr ||
+	    m->dp->dst.s_addr != dp->dst.s_addr)
+		return 0;
+#ifdef NS2
+	if (!m->dp->p || !dp->p)
+		return 0;
+
+	return HDR_CMN(m->dp->p)->uid() == HDR_CMN(dp->p)->uid();
+#else
+	return m->dp->nh.iph->id == dp->nh.iph->id;
+#endif
+}
+
+/* An overheard packet acknowledges a packet we are waiting for a passive ACK
+ * for if it is the same packet, sent on by our next hop. The forwarder is
+ * found from the source route, in which it has already decreased segments
+ * left. */
+int NSCLASS maint_buf_passive_ack(struct dsr_pkt *dp)
+{
+	struct dsr_srt_opt *srt_opt;
+	struct maint_entry *m = NULL;
+	struct maint_queue *q;
+	struct in_addr fwd;
+	unsigned int left;
+	list_t *pos;
+	int n, sleft;
+
+	if (!dp || !dp->srt_opt)
+		return 0;
+
+	srt_opt = dp->srt_opt;
+	n = (srt_opt->length - 2) / sizeof(struct in_addr);
+	sleft = srt_opt->sleft;
+
+	/* Sent by the source, so it was not forwarded */
+	if (sleft >= n)
+		return 0;
+
+	fwd.s_addr = srt_opt->addrs[n - sleft - 1];
+
+	DSR_WRITE_LOCK(&maint_buf.lock);
+
+	q = __maint_queue_find(&maint_buf_qtbl[maint_buf_hash(fwd)], fwd);
+
+	left = q ? q->len : 0;
+	pos = q ? q->pkts.next : NULL;
+
+	while (left--) {
+		struct maint_entry *e = list_entry(pos, struct maint_entry, ql);
+
+		pos = pos->next;
+
+		if (!(e->dp->flags & PKT_PASSIVE_ACK) || !e->dp->srt_opt ||
+		    e->dp->srt_opt->sleft != sleft + 1 ||
+		    !maint_entry_match(e, dp))
+			continue;
+
+		__maint_buf_detach(e);
+		m = e;
+		break;
+	}
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	if (!m)
+		return 0;
+
+	DEBUG("Passive ACK from %s id=%u\n", print_ip(fwd), m->id);
+#ifdef NS2
+	if (m->dp->p)
+		Packet::free(m->dp->p);
+#endif
+	dsr_pkt_free(m->dp);
+	FREE(m);
+
+	maint_buf_set_timeout();
+
+	return 1;
+}
+
 int NSCLASS maint_buf_del_addr(struct in_addr nxt_hop)
 {
-	struct maint_buf_query q;
+	list_t pkts, *pos;
+	usecs_t rtt = 0;
+	struct timeval now;
 	int n;
 
-	q.id = NULL;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
+	INIT_LIST(&pkts);
 
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
+	DSR_WRITE_LOCK(&maint_buf.lock);
+	n = __maint_buf_queue_detach(nxt_hop, &pkts);
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	gettime(&now);
+
+	list_for_each(pos, &pkts) {
+		struct maint_entry *m = (struct maint_entry *)pos;
 
-	/* Find the buffered packet to mark as acked */
-	n = tbl_for_each_del(&maint_buf, &q, crit_addr_del);
+		if (m->rexmt == 0)
+			rtt = timeval_diff(&now, &m->tx_time);
+	}
+
+	maint_entries_free(&pkts);
 	
-	if (q.rtt > 0) {
+	if (rtt > 0) {
 		struct neighbor_info neigh_info;
 		
 		neigh_info.id = 0;
-		neigh_info.rtt = q.rtt;
+		neigh_info.rtt = rtt;
 		neigh_tbl_set_rto(nxt_hop, &neigh_info);
 	}
 
@@ -684,6 +1011,7 @@ maint_buf_get_info(char *buffer, char **start, off_t offset, int length)
 
 int NSCLASS maint_buf_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 
@@ -697,6 +1025,11 @@ int NSCLASS maint_buf_init(void)
 #endif
 	INIT_TBL(&maint_buf, MAINT_BUF_MAX_LEN);
 
+	for (i = 0; i < MAINT_BUF_HASH_SIZE; i++)
+		INIT_LIST(&maint_buf_qtbl[i]);
+
+	maint_heap.len = 0;
+
 	init_timer(&ack_timer);
 
 	ack_timer.function = &NSCLASS maint_buf_timeout;
@@ -708,18 +1041,24 @@ int NSCLASS maint_buf_init(void)
 void NSCLASS maint_buf_cleanup(void)
 {
 	struct maint_entry *m;
+	list_t pkts;
 
 	del_timer_sync(&ack_timer);
 
-	while ((m = (struct maint_entry *)tbl_detach_first(&maint_buf))) {
-#ifdef NS2
-		if (m->dp->p)
-			Packet::free(m->dp->p);
-#endif
-		dsr_pkt_free(m->dp);
+	INIT_LIST(&pkts);
 
-		FREE(m);
+	DSR_WRITE_LOCK(&maint_buf.lock);
+
+	while (!TBL_EMPTY(&maint_buf)) {
+		m = (struct maint_entry *)TBL_FIRST(&maint_buf);
+		__maint_buf_detach(m);
+		list_add_tail(&m->l, &pkts);
 	}
+	DSR_WRITE_UNLOCK(&maint_buf.lock);
+
+	/* Queues are freed with their last packet */
+	maint_entries_free(&pkts);
+
 #ifdef __KERNEL__
 	proc_net_remove(MAINT_BUF_PROC_FS_NAME);
 #endif
@@ -8,6 +8,43 @@
 #ifndef _MAINT_BUF_H
 #define _MAINT_BUF_H
 
+#include "dsr.h"
+#include "tbl.h"
+
+#ifndef NO_GLOBALS
+
+#define MAINT_BUF_HASH_SIZE 32
+
+/* Packets waiting for an ACK from a neighbor, in ACK id order */
+struct maint_queue {
+	list_t l;		/* Hash bucket */
+	list_t pkts;
+	struct in_addr nxt_hop;
+	unsigned int len;
+};
+
+struct maint_entry {
+	list_t l;		/* All packets, in the order they were sent */
+	list_t ql;		/* Neighbor queue */
+	struct maint_queue *q;
+	unsigned int hidx;	/* Position in the deadline heap */
+	struct in_addr nxt_hop;
+	unsigned int rexmt;
+	unsigned short id;
+	struct timeval tx_time, expires;
+	usecs_t rto;
+	int ack_req_sent;
+	struct dsr_pkt *dp;
+};
+
+/* Binary min-heap of the buffered packets on expiry time */
+struct maint_heap {
+	unsigned int len;
+	struct maint_entry *e[MAINT_BUF_MAX_LEN];
+};
+
+#endif				/* NO_GLOBALS */
+
 #ifndef NO_DECLS
 
 int maint_buf_init(void);
@@ -17,10 +54,19 @@ void maint_buf_set_max_len(unsigned int max_len);
 int maint_buf_add(struct dsr_pkt *dp);
 int maint_buf_del_all(struct in_addr nxt_hop);
 int maint_buf_del_all_id(struct in_addr nxt_hop, unsigned short id);
+int maint_buf_del_sack(struct in_addr nxt_hop, unsigned short id,
+		       u_int32_t bitmap);
 int maint_buf_del_addr(struct in_addr nxt_hop);
+int maint_buf_passive_ack(struct dsr_pkt *dp);
 void maint_buf_set_timeout(void);
 void maint_buf_timeout(unsigned long data);
+void maint_buf_expire(struct maint_entry *m);
+int __maint_buf_add(struct maint_entry *m);
+void __maint_buf_detach(struct maint_entry *m);
+int __maint_buf_queue_detach(struct in_addr nxt_hop, list_t *pkts);
 int maint_buf_salvage(struct dsr_pkt *dp);
+int maint_buf_salvage_list(list_t *pkts);
+int maint_buf_link_failed(struct in_addr nxt_hop);
 
 #endif				/* NO_DECLS */
 
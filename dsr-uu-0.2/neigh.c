@@ -17,22 +17,28 @@
 #include "neigh.h"
 #include "debug.h"
 #include "timer.h"
+#include "dsr-probe.h"
+#include "link-cache.h"
 
-#define NEIGH_TBL_MAX_LEN 50
-
-/* We calculate RTO in milliseconds */
-#define DSR_SRTTBASE 0
-#define DSR_SRTTDFLT 60
-#define DSR_MIN 20
-#define DSR_REXMTMAX 1280
-#define DSR_RTTDFLT 30
-#define PR_SLOWHZ 2
-
+/* RTO estimation as in RFC 6298, in microseconds. SRTT and RTTVAR gain
+ * 1/8 and 1/4 */
 #define RTT_SHIFT 3
 #define RTTVAR_SHIFT 2
+#define K 4
+
+/* Clock granularity */
+#ifdef NS2
+#define RTO_G 1
+#else
+#define RTO_G (1000000 / HZ)
+#endif
 
-#define NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT 3000
-#define NEIGH_TBL_TIMEOUT 2000
+/* ACK REQ holdoff limits for a query, from the configuration */
+#define HOLDOFF_QUERY(q) do { \
+	(q)->holdoff_init = ConfValToUsecs(MaintHoldoffTime); \
+	(q)->holdoff_min = ConfValToUsecs(MaintHoldoffMin); \
+	(q)->holdoff_max = ConfValToUsecs(MaintHoldoffMax); \
+} while (0)
 
 #define DSR_RANGESET(tv, value, tvmin, tvmax) { \
         (tv) = (value); \
@@ -42,13 +48,16 @@
             (tv) = (tvmax); \
 }
 #define MAX(a,b) ( a > b ? a : b)
-#define K 4
 
-#define DSR_REXMTVAL(val) \
-        (((val) >> RTT_SHIFT) + (val))
+/* Link qualities are kept with 8 more bits of precision than reported */
+#define LQ_SHIFT 8
+#define PROBE_MAX_LOST 16
 
 #ifdef __KERNEL__
+/* Neighbors in the order they were last heard from or sent to, so that the
+ * head is the first to expire. Lookups go through neigh_tbl_hash. */
 static TBL(neigh_tbl, NEIGH_TBL_MAX_LEN);
+static list_t neigh_tbl_hash[NEIGH_TBL_HASH_SIZE];
 
 #define NEIGH_TBL_PROC_NAME "dsr_neigh_tbl"
 
@@ -58,18 +67,142 @@ static DSRUUTimer neigh_tbl_timer;
 
 struct neighbor {
 	list_t l;
+	list_t hl;		/* Hash bucket */
+	struct timeval last_seen;
 	struct in_addr addr;
 	struct sockaddr hw_addr;
 	unsigned short id;
 	struct timeval last_ack_req;
-	usecs_t t_srtt, rto, t_rxtcur, t_rttmin, t_rttvar, jitter;	/* RTT in usec */
+	usecs_t srtt, rttvar, rto;	/* In usecs, srtt 0 until first sample */
+	unsigned int backoff;	/* RTO doublings since the last sample */
+	usecs_t holdoff;	/* ACK REQ holdoff, 0 until adapted */
+	unsigned int fwd_lq, rev_lq;	/* Delivery ratios to and from */
+	int probe_seen;
+	unsigned short probe_seq;	/* Last probe received */
+	unsigned int probe_missed;	/* Probes found missing since then */
+	struct timeval probe_last;
+	usecs_t probe_interval;
+#ifdef NS2
+	int arp_set;
+#else
+	unsigned char hh[NEIGH_HH_MAX];	/* Prebuilt link layer header */
+	int hh_len, hh_ifindex;
+#endif
 };
 
 struct neighbor_query {
 	struct in_addr *addr;
 	struct neighbor_info *info;
+	unsigned int backoff;
+	usecs_t min_rto;
+	usecs_t holdoff_init, holdoff_min, holdoff_max;
+};
+
+struct probe_query {
+	unsigned short seq;
+	usecs_t interval;
+	int fwd_lq;
 };
 
+/* Move a link quality 1/8 towards a sample in 0 - NEIGH_LQ_MAX */
+static inline void lq_sample(unsigned int *lq, unsigned int sample)
+{
+	int d = (int)(sample << LQ_SHIFT) - (int)*lq;
+
+	*lq += d / 8;
+}
+
+/* Expected transmission count of the link in link cost units, i.e.,
+ * LC_COST_HOP for a perfect link */
+static inline unsigned int neigh_etx(struct neighbor *n)
+{
+	unsigned int d = (n->fwd_lq >> LQ_SHIFT) * (n->rev_lq >> LQ_SHIFT);
+	unsigned int etx;
+
+	if (!d)
+		return NEIGH_ETX_MAX * LC_COST_HOP;
+
+	etx = (NEIGH_LQ_MAX * NEIGH_LQ_MAX * LC_COST_HOP + d / 2) / d;
+
+	if (etx > NEIGH_ETX_MAX * LC_COST_HOP)
+		etx = NEIGH_ETX_MAX * LC_COST_HOP;
+
+	return etx;
+}
+
+static inline unsigned int neigh_hash(struct in_addr addr)
+{
+	return (addr.s_addr ^ (addr.s_addr >> 16)) % NEIGH_TBL_HASH_SIZE;
+}
+
+static inline struct neighbor *__neigh_find(list_t *bucket,
+					    struct in_addr addr)
+{
+	list_t *pos;
+
+	list_for_each(pos, bucket) {
+		struct neighbor *n = list_entry(pos, struct neighbor, hl);
+
+		if (n->addr.s_addr == addr.s_addr)
+			return n;
+	}
+	return NULL;
+}
+
+static inline void __neigh_detach(struct tbl *t, struct neighbor *n)
+{
+	list_del(&n->hl);
+	__tbl_detach(t, &n->l);
+}
+
+/* The neighbor is in use, move it to the back of the expiry order */
+static inline void __neigh_touch(struct tbl *t, struct neighbor *n)
+{
+	gettime(&n->last_seen);
+	list_del(&n->l);
+	list_add_tail(&n->l, &t->head);
+}
+
+/* The RTO in use, i.e., with backoff */
+static inline usecs_t neigh_rto(struct neighbor *n)
+{
+	usecs_t rto = n->rto;
+	unsigned int i;
+
+	for (i = 0; i < n->backoff && rto < NEIGH_RTO_MAX; i++)
+		rto <<= 1;
+
+	if (rto > NEIGH_RTO_MAX)
+		rto = NEIGH_RTO_MAX;
+
+	return rto;
+}
+
+/* Move the ACK REQ holdoff within its limits */
+static inline void holdoff_set(struct neighbor *n, struct neighbor_query *q,
+			       usecs_t holdoff)
+{
+	DSR_RANGESET(n->holdoff, holdoff, q->holdoff_min, q->holdoff_max);
+}
+
+/* The ACK REQ holdoff in use. It is shortened in proportion to the ETX of
+ * the link, but ACKs are never requested more often than once per RTO. */
+static inline usecs_t neigh_holdoff(struct neighbor *n,
+				    struct neighbor_query *q)
+{
+	usecs_t holdoff, min = q->holdoff_min;
+
+	holdoff = (n->holdoff ? n->holdoff : q->holdoff_init) * LC_COST_HOP /
+	    neigh_etx(n);
+
+	if (neigh_rto(n) > min)
+		min = neigh_rto(n);
+
+	DSR_RANGESET(holdoff, holdoff, min, q->holdoff_max);
+
+	return holdoff;
+}
+
 static inline int crit_addr(void *pos, void *query)
 {
 	struct neighbor_query *q = (struct neighbor_query *)query;
@@ -84,10 +217,19 @@ static inline int crit_addr(void *pos, void *query)
 			       sizeof(struct sockaddr));
 			
 			/* Return current RTO */
-			q->info->rto = n->t_rxtcur * 1000 / PR_SLOWHZ;
+			q->info->rto = neigh_rto(n);
+			q->info->fwd_lq = n->fwd_lq >> LQ_SHIFT;
+			q->info->rev_lq = n->rev_lq >> LQ_SHIFT;
+			q->info->holdoff = neigh_holdoff(n, q);
+#ifdef NS2
+			q->info->arp_set = n->arp_set;
+#else
+			q->info->hh_len = n->hh_len;
+			q->info->hh_ifindex = n->hh_ifindex;
 
-		/* 	if (q->info->rto < 1000000)  */
-/* 				q->info->rto = 1000000; */
+			if (n->hh_len)
+				memcpy(q->info->hh, n->hh, n->hh_len);
+#endif
 		}
 		return 1;
 	}
@@ -106,6 +248,71 @@ static inline int crit_addr_id_inc(void *pos, void *addr)
 	}
 	return 0;
 }
+#ifdef NS2
+static inline int set_arp(void *pos, void *addr)
+{
+	struct neighbor *n = (struct neighbor *)pos;
+
+	n->arp_set = 1;
+	return 1;
+}
+#else
+static inline int set_hh(void *pos, void *query)
+{
+	struct neighbor_info *info = (struct neighbor_info *)query;
+	struct neighbor *n = (struct neighbor *)pos;
+
+	memcpy(n->hh, info->hh, info->hh_len);
+	n->hh_len = info->hh_len;
+	n->hh_ifindex = info->hh_ifindex;
+	return 1;
+}
+#endif
+
+static inline int probe_recv(void *pos, void *data)
+{
+	struct probe_query *pq = (struct probe_query *)data;
+	struct neighbor *n = (struct neighbor *)pos;
+
+	if (n->probe_seen) {
+		short gap = (short)(pq->seq - n->probe_seq);
+		int lost;
+
+		/* Duplicate or reordered */
+		if (gap <= 0)
+			return 1;
+
+		/* Some losses may already have been counted by the tick */
+		lost = gap - 1 - (int)n->probe_missed;
+
+		if (lost > PROBE_MAX_LOST)
+			lost = PROBE_MAX_LOST;
+
+		while (lost-- > 0)
+			lq_sample(&n->rev_lq, 0);
+	}
+	lq_sample(&n->rev_lq, NEIGH_LQ_MAX);
+
+	if (pq->fwd_lq >= 0)
+		lq_sample(&n->fwd_lq, pq->fwd_lq);
+
+	n->probe_seen = 1;
+	n->probe_seq = pq->seq;
+	n->probe_missed = 0;
+	n->probe_interval = pq->interval;
+	gettime(&n->probe_last);
+
+	return 1;
+}
+
+static inline int link_cost(void *pos, void *data)
+{
+	struct neighbor *n = (struct neighbor *)pos;
+
+	*(unsigned int *)data = neigh_etx(n);
+	return 1;
+}
+
 static inline int set_ack_req_time(void *pos, void *addr)
 {
 	struct in_addr *a = (struct in_addr *)addr;
@@ -124,47 +331,116 @@ static inline int rto_calc(void *pos, void *query)
 	struct neighbor *n = (struct neighbor *)pos;
 	
 	if (n->addr.s_addr == q->addr->s_addr) {
-		struct timeval now;
-		usecs_t rtt = q->info->rtt;
-		int delta;
-		
-		gettime(&now);
-	
-		if (n->t_srtt != 0) {
-			delta = rtt - 1 - (n->t_srtt >> RTT_SHIFT);
-			
-			if ((n->t_srtt += delta) <= 0)
-				n->t_srtt = 1;
-			
+		long rtt = q->info->rtt;
+		long delta;
+
+		if (rtt <= 0)
+			rtt = 1;
+
+		if (n->srtt != 0) {
+			delta = rtt - (long)n->srtt;
+
+			n->srtt += delta >> RTT_SHIFT;
+
 			if (delta < 0)
 				delta = -delta;
-			
-			delta -= (n->t_rttvar >> RTTVAR_SHIFT);
-			
-			if ((n->t_rttvar += delta) <= 0)
-				n->t_rttvar = 1;
+
+			n->rttvar += (delta - (long)n->rttvar) >> RTTVAR_SHIFT;
 		} else {
-			n->t_srtt = rtt << RTT_SHIFT;
-			n->t_rttvar = rtt << (RTTVAR_SHIFT - 1);
+			n->srtt = rtt;
+			n->rttvar = rtt >> 1;
 		}
-		
-		DSR_RANGESET(n->t_rxtcur, DSR_REXMTVAL(n->t_srtt),
-			     n->t_rttmin, DSR_REXMTMAX);
-		
+
+		/* Samples are only taken from packets that were not
+		 * retransmitted (Karn), so a sample ends any backoff */
+		n->backoff = 0;
+
+		DSR_RANGESET(n->rto, n->srtt + MAX(RTO_G, K * n->rttvar),
+			     q->min_rto, NEIGH_RTO_MAX);
+
+		/* Additive increase of the ACK REQ holdoff for every ACK */
+		holdoff_set(n, q, (n->holdoff ? n->holdoff : q->holdoff_init) +
+			    q->holdoff_min);
+
 		return 1;
 	}
 	return 0;
 }
-/* TODO: Implement neighbor table garbage collection */
+
+static inline int rto_backoff(void *pos, void *query)
+{
+	struct neighbor_query *q = (struct neighbor_query *)query;
+	struct neighbor *n = (struct neighbor *)pos;
+
+	if (n->addr.s_addr == q->addr->s_addr) {
+		/* Only an ACK REQ that timed out counts as a loss, held off
+		 * packets expiring do not. A new loss halves the ACK REQ
+		 * holdoff. */
+		if (q->backoff > n->backoff) {
+			n->backoff = q->backoff;
+			holdoff_set(n, q, (n->holdoff ? n->holdoff :
+					   q->holdoff_init) / 2);
+		}
+
+		q->info->rto = neigh_rto(n);
+		return 1;
+	}
+	return 0;
+}
+/* Look up a neighbor through the hash and apply func to it, with the table
+ * locked */
+int NSCLASS neigh_tbl_find_do(struct in_addr addr, void *data, do_t func)
+{
+	struct neighbor *n;
+	int res = 0;
+
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	n = __neigh_find(&neigh_tbl_hash[neigh_hash(addr)], addr);
+
+	if (n)
+		res = func(n, data);
+
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+
+	return res;
+}
+
+/* Remove neighbors that have been neither heard from nor sent to for
+ * NeighborTimeout. They are kept in that order, so only the expired ones at
+ * the head are looked at. */
 void NSCLASS neigh_tbl_garbage_timeout(unsigned long data)
 {
-	/* tbl_for_each_del(&neigh_tbl, NULL, crit_garbage); */
+	struct neighbor *n;
+	struct timeval now, expires;
+	usecs_t timeout = ConfValToUsecs(NeighborTimeout);
+	int rearm = 0, num = 0;
+
+	gettime(&now);
+
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	while (!TBL_EMPTY(&neigh_tbl)) {
+		n = (struct neighbor *)TBL_FIRST(&neigh_tbl);
+
+		expires = n->last_seen;
+		timeval_add_usecs(&expires, timeout);
+
+		if (timeval_diff(&expires, &now) > 0) {
+			rearm = 1;
+			break;
+		}
+		__neigh_detach(&neigh_tbl, n);
+		FREE(n);
+		num++;
+	}
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
 
-/* 	if (!tbl_empty(&neigh_tbl)) { */
-	/*      garbage_timer.expires = TimeNow +  */
-/* 			MSECS_TO_TIMENOW(NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT); */
-	/*      add_timer(&garbage_timer);       */
-	/* } */
+	if (num)
+		DEBUG("Removed %d idle neighbors\n", num);
+
+	if (rearm)
+		set_timer(&neigh_tbl_timer, &expires);
 }
 
 static struct neighbor *neigh_tbl_create(struct in_addr addr,
@@ -182,18 +458,18 @@ static struct neighbor *neigh_tbl_create(struct in_addr addr,
 
 	neigh->id = id;
 	neigh->addr = addr;
-	neigh->t_srtt = DSR_SRTTBASE;
-	neigh->t_rttvar = DSR_RTTDFLT * PR_SLOWHZ << 2;
-	neigh->t_rttmin = DSR_MIN;
-	DSR_RANGESET(neigh->t_rxtcur, 
-		     ((DSR_SRTTBASE >> 2) + (DSR_SRTTDFLT << 2)) >> 1, 
-		     DSR_MIN, DSR_REXMTMAX);
+	neigh->srtt = 0;
+	neigh->rttvar = 0;
+	neigh->backoff = 0;
+	neigh->rto = NEIGH_RTO_INIT;
+
+	/* Assume a good link until probes say otherwise */
+	neigh->fwd_lq = NEIGH_LQ_MAX << LQ_SHIFT;
+	neigh->rev_lq = NEIGH_LQ_MAX << LQ_SHIFT;
 
 	memset(&neigh->last_ack_req, 0, sizeof(struct timeval));
 	memcpy(&neigh->hw_addr, hw_addr, sizeof(struct sockaddr));
-
-/* 	garbage_timer.expires = TimeNow + NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT / 1000*HZ; */
-/* 	add_timer(&garbage_timer); */
+	gettime(&neigh->last_seen);
 
 	return neigh;
 }
@@ -205,13 +481,19 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 #endif
 {
 	struct sockaddr hw_addr;
-	struct neighbor *neigh;
-	struct neighbor_query q;
+	struct neighbor *neigh, *old = NULL;
+	list_t *bucket = &neigh_tbl_hash[neigh_hash(neigh_addr)];
 
-	q.addr = &neigh_addr;
-	q.info = NULL;
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
 
-	if (in_tbl(&neigh_tbl, &q, crit_addr))
+	neigh = __neigh_find(bucket, neigh_addr);
+
+	if (neigh)
+		__neigh_touch(&neigh_tbl, neigh);
+
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+
+	if (neigh)
 		return 0;
 #ifdef NS2
 	/* This should probably be changed to lookup the MAC type
@@ -235,19 +517,125 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 		DEBUG("Could not create new neighbor entry\n");
 		return -1;
 	}
-	tbl_add(&neigh_tbl, &neigh->l, crit_none);
+
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	/* Added by someone else meanwhile */
+	if (__neigh_find(bucket, neigh_addr)) {
+		DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+		FREE(neigh);
+		return 0;
+	}
+
+	/* Make room by dropping the neighbor idle the longest */
+	if (TBL_FULL(&neigh_tbl) && !TBL_EMPTY(&neigh_tbl)) {
+		old = (struct neighbor *)TBL_FIRST(&neigh_tbl);
+		__neigh_detach(&neigh_tbl, old);
+	}
+
+	if (__tbl_add_tail(&neigh_tbl, &neigh->l) < 0) {
+		DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+		FREE(neigh);
+		if (old)
+			FREE(old);
+		return -1;
+	}
+	list_add(&neigh->hl, bucket);
+
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+
+	if (old) {
+		DEBUG("Neighbor table full, dropped %s\n", print_ip(old->addr));
+		FREE(old);
+	}
+
+	if (!timer_pending(&neigh_tbl_timer)) {
+		struct timeval expires = neigh->last_seen;
+
+		timeval_add_usecs(&expires, ConfValToUsecs(NeighborTimeout));
+		set_timer(&neigh_tbl_timer, &expires);
+	}
 
 	return 1;
 }
 
 int NSCLASS neigh_tbl_del(struct in_addr neigh_addr)
 {
-	return tbl_for_each_del(&neigh_tbl, &neigh_addr, crit_addr);
+	struct neighbor *n;
+
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	n = __neigh_find(&neigh_tbl_hash[neigh_hash(neigh_addr)], neigh_addr);
+
+	if (n)
+		__neigh_detach(&neigh_tbl, n);
+
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+
+	if (!n)
+		return 0;
+
+	FREE(n);
+
+	return 1;
+}
+
+void NSCLASS neigh_tbl_set_max_len(unsigned int max_len)
+{
+	neigh_tbl.max_len = max_len;
+}
+
+/* The link layer header to a neighbor only depends on its hardware address,
+ * so it is built once and then copied into every packet. In ns-2 the same
+ * goes for the ARP entry. */
+#ifdef NS2
+int NSCLASS neigh_tbl_set_arp(struct in_addr neigh_addr)
+{
+	return neigh_tbl_find_do(neigh_addr, NULL, set_arp);
+}
+#else
+int NSCLASS neigh_tbl_set_hh(struct in_addr neigh_addr, unsigned char *hh,
+			     int len, int ifindex)
+{
+	struct neighbor_info info;
+
+	if (len <= 0 || len > NEIGH_HH_MAX)
+		return -1;
+
+	memcpy(info.hh, hh, len);
+	info.hh_len = len;
+	info.hh_ifindex = ifindex;
+
+	return neigh_tbl_find_do(neigh_addr, &info, set_hh);
+}
+
+/* Find the neighbor with a hardware address */
+int NSCLASS neigh_tbl_hw_lookup(unsigned char *hw_addr,
+				struct in_addr *neigh_addr)
+{
+	list_t *pos;
+	int res = 0;
+
+	DSR_READ_LOCK(&neigh_tbl.lock);
+
+	list_for_each(pos, &neigh_tbl.head) {
+		struct neighbor *n = (struct neighbor *)pos;
+
+		if (memcmp(n->hw_addr.sa_data, hw_addr, ETH_ALEN) == 0) {
+			*neigh_addr = n->addr;
+			res = 1;
+			break;
+		}
+	}
+	DSR_READ_UNLOCK(&neigh_tbl.lock);
+
+	return res;
 }
+#endif
 
 int NSCLASS neigh_tbl_set_ack_req_time(struct in_addr neigh_addr)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, set_ack_req_time);
+	return neigh_tbl_find_do(neigh_addr, &neigh_addr, set_ack_req_time);
 }
 
 int NSCLASS 
@@ -257,24 +645,143 @@ neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
 	
 	q.addr = &neigh_addr;
 	q.info = neigh_info;
+	q.min_rto = ConfValToUsecs(MaintMinRTO);
+	HOLDOFF_QUERY(&q);
 	
-	return tbl_find_do(&neigh_tbl, &q, rto_calc);
+	return neigh_tbl_find_do(neigh_addr, &q, rto_calc);
+}
+
+/* A probe was received from a neighbor. fwd_lq is the share of our probes
+ * it reports having received, or -1 if it did not say. */
+int NSCLASS neigh_tbl_probe_recv(struct in_addr neigh_addr, unsigned short seq,
+				 usecs_t interval, int fwd_lq)
+{
+	struct probe_query pq;
+
+	pq.seq = seq;
+	pq.interval = interval;
+	pq.fwd_lq = fwd_lq;
+
+	return neigh_tbl_find_do(neigh_addr, &pq, probe_recv);
+}
+
+/* Count the probes overdue from each neighbor as lost. Some jitter is
+ * allowed before a probe is considered missing. */
+void NSCLASS neigh_tbl_probe_tick(void)
+{
+	struct timeval now;
+	list_t *pos;
+
+	gettime(&now);
+
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	list_for_each(pos, &neigh_tbl.head) {
+		struct neighbor *n = (struct neighbor *)pos;
+		unsigned int missed;
+
+		if (!n->probe_seen || !n->probe_interval)
+			continue;
+
+		missed = timeval_diff(&now, &n->probe_last) /
+		    (n->probe_interval + n->probe_interval / 4);
+
+		if (missed > PROBE_MAX_LOST)
+			missed = PROBE_MAX_LOST;
+
+		while (n->probe_missed < missed) {
+			lq_sample(&n->rev_lq, 0);
+			n->probe_missed++;
+		}
+	}
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+}
+
+/* Fill in the delivery ratio of every neighbor we have had probes from, for
+ * our own probe */
+int NSCLASS neigh_tbl_probe_fill(struct dsr_probe_lq *lq, int max)
+{
+	list_t *pos;
+	int n = 0;
+
+	DSR_READ_LOCK(&neigh_tbl.lock);
+
+	/* Most recently used neighbors first */
+	for (pos = neigh_tbl.head.prev; pos != &neigh_tbl.head && n < max;
+	     pos = pos->prev) {
+		struct neighbor *neigh = (struct neighbor *)pos;
+
+		if (!neigh->probe_seen)
+			continue;
+
+		lq[n].addr = neigh->addr.s_addr;
+		lq[n].lq = neigh->rev_lq >> LQ_SHIFT;
+		memset(lq[n].res, 0, sizeof(lq[n].res));
+		n++;
+	}
+	DSR_READ_UNLOCK(&neigh_tbl.lock);
+
+	return n;
+}
+
+/* Cost of the link to a neighbor for the link cache. LC_COST_HOP unless
+ * probes show the link to be lossy. */
+int NSCLASS neigh_tbl_link_cost(struct in_addr neigh_addr)
+{
+	unsigned int cost = LC_COST_HOP;
+
+	neigh_tbl_find_do(neigh_addr, &cost, link_cost);
+
+	return cost;
+}
+
+/* Back off the RTO of a neighbor after the ACK REQ for a packet to it timed
+ * out n times. Not for packets that had no ACK REQ sent. Several packets may time out for the same loss, so the backoff is that of
+ * the most retransmitted packet rather than a doubling per timeout. Returns
+ * the new RTO, or 0 if the neighbor is unknown. */
+usecs_t NSCLASS neigh_tbl_rto_backoff(struct in_addr neigh_addr, unsigned int n)
+{
+	struct neighbor_info neigh_info;
+	struct neighbor_query q;
+
+	q.addr = &neigh_addr;
+	q.info = &neigh_info;
+	q.backoff = n;
+	HOLDOFF_QUERY(&q);
+
+	if (!neigh_tbl_find_do(neigh_addr, &q, rto_backoff))
+		return 0;
+
+	return neigh_info.rto;
 }
 
 int NSCLASS
 neigh_tbl_query(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
 {
 	struct neighbor_query q;
+	struct neighbor *n;
 
 	q.addr = &neigh_addr;
 	q.info = neigh_info;
+	HOLDOFF_QUERY(&q);
 
-	return in_tbl(&neigh_tbl, &q, crit_addr);
+	DSR_WRITE_LOCK(&neigh_tbl.lock);
+
+	n = __neigh_find(&neigh_tbl_hash[neigh_hash(neigh_addr)], neigh_addr);
+
+	/* Sending to the neighbor keeps it from expiring */
+	if (n) {
+		crit_addr(n, &q);
+		__neigh_touch(&neigh_tbl, n);
+	}
+	DSR_WRITE_UNLOCK(&neigh_tbl.lock);
+
+	return n ? 1 : 0;
 }
 
 int NSCLASS neigh_tbl_id_inc(struct in_addr neigh_addr)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, crit_addr_id_inc);
+	return neigh_tbl_find_do(neigh_addr, &neigh_addr, crit_addr_id_inc);
 }
 
 #ifdef __KERNEL__
@@ -286,16 +793,22 @@ static int neigh_tbl_print(char *buf)
 	DSR_READ_LOCK(&neigh_tbl.lock);
 
 	len +=
-	    sprintf(buf, "# %-15s %-17s %-10s %-6s\n", "Addr", "HwAddr",
-		    "RTO (usec)", "Id" /*, "AckRxTime","AckTxTime" */ );
+	    sprintf(buf, "# %-15s %-17s %-10s %-10s %-10s %-6s %-4s %-4s %-5s\n",
+		    "Addr", "HwAddr", "SRTT", "RTTVAR", "RTO (usec)",
+		    "Id", "FwLQ", "RvLQ", "ETX" /*, "AckRxTime","AckTxTime" */ );
 
 	list_for_each(pos, &neigh_tbl.head) {
 		struct neighbor *neigh = (struct neighbor *)pos;
 
-		len += sprintf(buf + len, "  %-15s %-17s %-10lu %-6u\n",
+		len += sprintf(buf + len,
+			       "  %-15s %-17s %-10lu %-10lu %-10lu %-6u %-4u %-4u %2u.%02u\n",
 			       print_ip(neigh->addr),
 			       print_eth(neigh->hw_addr.sa_data),
-			       neigh->t_rxtcur, neigh->id);
+			       neigh->srtt, neigh->rttvar, neigh_rto(neigh),
+			       neigh->id, neigh->fwd_lq >> LQ_SHIFT,
+			       neigh->rev_lq >> LQ_SHIFT,
+			       neigh_etx(neigh) / LC_COST_HOP,
+			       neigh_etx(neigh) % LC_COST_HOP * 100 / LC_COST_HOP);
 	}
 
 	DSR_READ_UNLOCK(&neigh_tbl.lock);
@@ -323,11 +836,17 @@ neigh_tbl_proc_info(char *buffer, char **start, off_t offset, int length)
 
 int __init NSCLASS neigh_tbl_init(void)
 {
-	INIT_TBL(&neigh_tbl, NEIGH_TBL_MAX_LEN);
+	int i;
+
+	INIT_TBL(&neigh_tbl, ConfVal(NeighborTableSize));
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++)
+		INIT_LIST(&neigh_tbl_hash[i]);
 
 	init_timer(&neigh_tbl_timer);
 
 	neigh_tbl_timer.function = &NSCLASS neigh_tbl_garbage_timeout;
+	neigh_tbl_timer.data = 0;
 
 #ifdef __KERNEL__
 	proc_net_create(NEIGH_TBL_PROC_NAME, 0, neigh_tbl_proc_info);
@@ -337,6 +856,9 @@ int __init NSCLASS neigh_tbl_init(void)
 
 void __exit NSCLASS neigh_tbl_cleanup(void)
 {
+	if (timer_pending(&neigh_tbl_timer))
+		del_timer_sync(&neigh_tbl_timer);
+
 	tbl_flush(&neigh_tbl, crit_none);
 
 #ifdef __KERNEL__
@@ -13,14 +13,33 @@
 #endif
 
 #include "dsr.h"
+#include "tbl.h"
+#include "dsr-probe.h"
 
 #ifndef NO_GLOBALS
 
+#define NEIGH_TBL_HASH_SIZE 64
+#define NEIGH_HH_MAX 32		/* Largest cached link layer header */
+#define NEIGH_LQ_MAX 255	/* Link quality of a loss free link */
+#define NEIGH_ETX_MAX 16
+
+/* RTO before the first RTT sample and upper bound, in usecs */
+#define NEIGH_RTO_INIT 60000
+#define NEIGH_RTO_MAX  640000
+
 struct neighbor_info {  //存储邻居节点信息的结构体
 	struct sockaddr hw_addr;
 	unsigned short id;
 	usecs_t rtt, rto;		/* RTT and Round Trip Timeout */
 	struct timeval last_ack_req;
+	usecs_t holdoff;		/* Time between ACK REQs */
+	unsigned int fwd_lq, rev_lq;	/* Delivery ratio to and from it */
+#ifdef NS2
+	int arp_set;		/* ARP entry installed for the neighbor */
+#else
+	unsigned char hh[NEIGH_HH_MAX];	/* Link layer header to the neighbor */
+	int hh_len, hh_ifindex;
+#endif
 };
 
 #endif				/* NO_GLOBALS */
@@ -36,7 +55,22 @@ int neigh_tbl_query(struct in_addr neigh_addr,
 		    struct neighbor_info *neigh_info);
 int neigh_tbl_id_inc(struct in_addr neigh_addr);
 int neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info);
+usecs_t neigh_tbl_rto_backoff(struct in_addr neigh_addr, unsigned int n);
 int neigh_tbl_set_ack_req_time(struct in_addr neigh_addr);
+int neigh_tbl_find_do(struct in_addr addr, void *data, do_t func);
+void neigh_tbl_set_max_len(unsigned int max_len);
+int neigh_tbl_probe_recv(struct in_addr neigh_addr, unsigned short seq,
+			 usecs_t interval, int fwd_lq);
+void neigh_tbl_probe_tick(void);
+int neigh_tbl_probe_fill(struct dsr_probe_lq *lq, int max);
+int neigh_tbl_link_cost(struct in_addr neigh_addr);
+#ifdef NS2
+int neigh_tbl_set_arp(struct in_addr neigh_addr);
+#else
+int neigh_tbl_set_hh(struct in_addr neigh_addr, unsigned char *hh, int len,
+		     int ifindex);
+int neigh_tbl_hw_lookup(unsigned char *hw_addr, struct in_addr *neigh_addr);
+#endif
 void neigh_tbl_garbage_timeout(unsigned long data);
 
 int neigh_tbl_init(void);
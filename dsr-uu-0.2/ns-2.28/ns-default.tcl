@@ -1369,4 +1369,21 @@ Agent/DSRUU set TryPassiveAcks_ 1
 Agent/DSRUU set PassiveAckTimeout_ 100
 Agent/DSRUU set GratReplyHoldOff_ 1
 Agent/DSRUU set MAX_SALVAGE_COUNT_ 15
+Agent/DSRUU set RouteLearnInterval_ 1000
+Agent/DSRUU set SendBufferBytes_ 150000
+Agent/DSRUU set SendBufferDstSize_ 50
+Agent/DSRUU set RREQSuppressCount_ 0
+Agent/DSRUU set RREQBatchWindow_ 0
+Agent/DSRUU set RouteRefreshMargin_ 5
+Agent/DSRUU set UseSelectiveAck_ 0
+Agent/DSRUU set AckCoalesceTime_ 10
+Agent/DSRUU set AckPiggyback_ 0
+Agent/DSRUU set MaintMinRTO_ 5
+Agent/DSRUU set NeighborTableSize_ 256
+Agent/DSRUU set NeighborTimeout_ 60
+Agent/DSRUU set ProbeInterval_ 0
+Agent/DSRUU set UseLinkLayerFeedback_ 0
+Agent/DSRUU set LinkTxFailed_ 0
+Agent/DSRUU set MaintHoldoffMin_ 20
+Agent/DSRUU set MaintHoldoffMax_ 1000
 
@@ -0,0 +1,142 @@
+#
+# rreq-suppress.tcl:
+# Dense grid scenario for measuring counter based RREQ rebroadcast
+# suppression in DSR-UU.
+#
+# Usage: ns rreq-suppress.tcl [-suppress k] [-side n] [-flows f]
+#
+# With "-suppress 0" (the default) every node rebroadcasts each new RREQ
+# immediately. With k > 0 a node holds the rebroadcast for a random time
+# of up to BroadCastJitter and cancels it after hearing k copies.
+#
+# The number of RREQ transmissions is found in the trace by counting
+# routing layer sends of broadcast DSR packets, e.g.:
+#
+#   grep "^s.*RTR.*DSRUU.*ffffffff" rreq-suppress-k.tr | wc -l
+#
+# Delivered ping replies are printed at the end of the run.
+#
+# NOTE: Requires tracing support for packets of type PT_PING to be added
+# to cmu-trace.cc.
+
+# ======================================================================
+# Define options
+# ======================================================================
+
+set val(chan)           Channel/WirelessChannel
+set val(prop)           Propagation/TwoRayGround
+set val(netif)          Phy/WirelessPhy
+set val(mac)            Mac/802_11
+set val(ifq)            CMUPriQueue
+set val(ll)             LL
+set val(ant)            Antenna/OmniAntenna
+set val(ifqlen)         50      ;# max packet in ifq
+set val(adhocRP)        DSRUU
+set val(spacing)        100.0   ;# distance between grid neighbors (m)
+set val(stop)           100.0   ;# simulation time
+set opt(suppress)       0
+set opt(side)           7
+set opt(flows)          5
+
+proc getopt {argc argv} {
+    global opt
+
+    for {set i 0} {$i < $argc} {incr i} {
+	set arg [lindex $argv $i]
+
+	if {[string range $arg 0 0] != "-"} continue
+
+	set name [string range $arg 1 end]
+	set opt($name) [lindex $argv [expr $i+1]]
+    }
+}
+
+getopt $argc $argv
+
+set val(nn) [expr $opt(side) * $opt(side)]
+set val(x)  [expr $opt(side) * $val(spacing)]
+set val(y)  $val(x)
+set val(tr) rreq-suppress-$opt(suppress).tr
+
+puts "Running $val(nn) nodes with RREQSuppressCount $opt(suppress)"
+
+Agent/DSRUU set RREQSuppressCount_ $opt(suppress)
+
+set ns_ [new Simulator]
+set topo [new Topography]
+
+set tracefd [open $val(tr) w]
+$ns_ trace-all $tracefd
+
+$topo load_flatgrid $val(x) $val(y)
+
+set god_ [create-god $val(nn)]
+
+$ns_ node-config -adhocRouting $val(adhocRP) \
+	-llType $val(ll) \
+	-macType $val(mac) \
+	-ifqType $val(ifq) \
+	-ifqLen $val(ifqlen) \
+	-antType $val(ant) \
+	-propType $val(prop) \
+	-phyType $val(netif) \
+	-channelType $val(chan) \
+	-topoInstance $topo \
+	-agentTrace ON \
+	-routerTrace ON \
+	-macTrace OFF
+
+# Place the nodes on a grid so that every node has up to eight neighbors
+# within range (default range of TwoRayGround is 250 m)
+for {set i 0} {$i < $val(nn)} {incr i} {
+    set node_($i) [$ns_ node]
+    $node_($i) random-motion 0
+
+    $node_($i) set X_ [expr ($i % $opt(side)) * $val(spacing) + 1.0]
+    $node_($i) set Y_ [expr ($i / $opt(side)) * $val(spacing) + 1.0]
+    $node_($i) set Z_ 0.0
+}
+
+set replies 0
+
+Agent/Ping instproc recv {from rtt} {
+    global replies
+    incr replies
+}
+
+# Ping once a second between random node pairs, flows start one second
+# apart so that their route discoveries do not overlap
+for {set f 0} {$f < $opt(flows)} {incr f} {
+    set src [expr int(rand() * $val(nn))]
+    set dst [expr int(rand() * $val(nn))]
+
+    if {$src == $dst} {
+	set dst [expr ($dst + 1) % $val(nn)]
+    }
+    set ping(s$f) [new Agent/Ping]
+    set ping(d$f) [new Agent/Ping]
+    $ns_ attach-agent $node_($src) $ping(s$f)
+    $ns_ attach-agent $node_($dst) $ping(d$f)
+    $ns_ connect $ping(s$f) $ping(d$f)
+
+    for {set t [expr 1.0 + $f]} {$t < $val(stop)} {set t [expr $t + 1.0]} {
+	$ns_ at $t "$ping(s$f) send"
+    }
+}
+
+for {set i 0} {$i < $val(nn) } {incr i} {
+    $ns_ at $val(stop).0 "$node_($i) reset";
+}
+
+proc stop {} {
+    global ns_ tracefd replies
+    $ns_ flush-trace
+    close $tracefd
+    puts "Ping replies received: $replies"
+}
+
+$ns_ at $val(stop).0001 "stop"
+$ns_ at $val(stop).0002 "puts \"NS EXITING...\" ; $ns_ halt"
+
+puts "Starting Simulation..."
+$ns_ run
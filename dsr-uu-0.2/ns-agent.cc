@@ -38,7 +38,12 @@ DSRUU::DSRUU() : Agent(PT_DSR),
 		 grat_rrep_tbl_timer(this, "GratRREPTimer"), 
 		 send_buf_timer(this, "SendBufTimer"), 
 		 neigh_tbl_timer(this, "NeighTblTimer"), 
-		 lc_timer(this, "LinkCacheTimer")
+		 lc_timer(this, "LinkCacheTimer"),
+		 rreq_fwd_timer(this, "RREQFwdTimer"),
+		 rreq_tbl_timer(this, "RREQTblTimer"),
+		 rreq_batch_timer(this, "RREQBatchTimer"),
+		 ack_tbl_timer(this, "ACKTblTimer"),
+		 probe_timer(this, "ProbeTimer")
 {
 	int i;
 	
@@ -69,7 +74,12 @@ DSRUU::DSRUU() : Agent(PT_DSR),
 	rreq_tbl_init();
 	grat_rrep_tbl_init();
 	maint_buf_init();
+	dsr_ack_init();
 	send_buf_init();
+	dsr_probe_init();
+
+	memset(srt_flow_tbl, 0, sizeof(srt_flow_tbl));
+	memset(srt_tmpl_tbl, 0, sizeof(srt_tmpl_tbl));
 	
 	myaddr_.s_addr = 0;
 
@@ -84,6 +94,8 @@ DSRUU::~DSRUU()
 	grat_rrep_tbl_cleanup();
 	send_buf_cleanup();
  	maint_buf_cleanup();
+	dsr_ack_cleanup();
+	dsr_probe_cleanup();
 
 	exit(-1);
 }
@@ -282,8 +294,11 @@ Packet *DSRUU::ns_packet_create(struct dsr_pkt *dp)
 		mac_->hdr_dst((char*) HDR_MAC(dp->p), mac_dst);
 		cmh->addr_type() = NS_AF_INET;
 
-		// Generate fake ARP 
-		arpset(dp->nxt_hop, mac_dst);
+		// Generate fake ARP, once per neighbor
+		if (!neigh_info.arp_set) {
+			arpset(dp->nxt_hop, mac_dst);
+			neigh_tbl_set_arp(dp->nxt_hop);
+		}
 	}
 
 	// Copy message contents into packet
@@ -325,6 +340,9 @@ void DSRUU::ns_xmit(struct dsr_pkt *dp)
 
  	if (dp->flags & PKT_REQUEST_ACK)	
  		maint_buf_add(dp);
+
+	/* After buffering, so that retransmissions do not repeat the ACK */
+	dsr_ack_piggyback(dp);
 	
 	p = ns_packet_create(dp);
 
@@ -397,6 +415,12 @@ void DSRUU::recv(Packet* p, Handler*)
 	DEBUG("##########\n");
 
 	dp = dsr_pkt_alloc(p);
+
+	if (!dp) {
+		DEBUG("Could not allocate DSR packet\n");
+		drop(p, DROP_RTR_NO_ROUTE);
+		return;
+	}
 	
 	switch(cmh->ptype()) {
 	case PT_DSR:
@@ -455,6 +479,10 @@ void DSRUU::tap(const Packet *p_in)
 	} while (0);
 	
 	dp = dsr_pkt_alloc(p);
+
+	if (!dp)
+		return;
+
 	dp->flags |= PKT_PROMISC_RECV;
 
 	/* TODO: See if this node is the next hop. In that case do nothing */
@@ -466,6 +494,10 @@ void DSRUU::tap(const Packet *p_in)
 			dsr_recv(dp);
 		} else {
 // 			DEBUG("Locally gernerated DSR packet\n");
+			/* Forwarded by our next hop, a passive ACK */
+			if (ConfVal(TryPassiveAcks))
+				maint_buf_passive_ack(dp);
+
 			dsr_pkt_free(dp);
 		}
 		break;
@@ -45,8 +45,10 @@ class DSRUU;
 #include "dsr-rrep.h"
 #include "dsr-rerr.h"
 #include "dsr-ack.h"
+#include "dsr-probe.h"
 #include "dsr-srt.h"
 #include "neigh.h"
+#include "maint-buf.h"
 #include "link-cache.h"
 #undef NO_DECLS
 
@@ -141,6 +143,9 @@ class DSRUU:public Tap, public Agent {
 #undef _DSR_ACK_H
 #include "dsr-ack.h"
 
+#undef _DSR_PROBE_H
+#include "dsr-probe.h"
+
 #undef _DSR_SRT_H
 #include "dsr-srt.h"
 
@@ -184,17 +189,36 @@ class DSRUU:public Tap, public Agent {
 	MobileNode *node_;
 
 	struct tbl rreq_tbl;
+	list_t rreq_tbl_idx[RREQ_TBL_HASH_SIZE];
+	list_t rreq_disc_list;
+	struct rreq_batch rreq_batch;
+	struct tbl rreq_fwd_tbl;
 	struct tbl grat_rrep_tbl;
 	struct tbl send_buf;
+	list_t send_buf_qtbl[SEND_BUF_HASH_SIZE];
+	struct send_buf_stats send_buf_stats;
 	struct tbl neigh_tbl;
+	list_t neigh_tbl_hash[NEIGH_TBL_HASH_SIZE];
 	struct tbl maint_buf;
+	struct tbl ack_tbl;
+	list_t maint_buf_qtbl[MAINT_BUF_HASH_SIZE];
+	struct maint_heap maint_heap;
+
+	struct srt_flow srt_flow_tbl[SRT_FLOW_TBL_SIZE];
+	struct srt_tmpl srt_tmpl_tbl[SRT_TMPL_TBL_SIZE];
 
 	unsigned int rreq_seqno;
+	unsigned short probe_seq;
 
 	DSRUUTimer grat_rrep_tbl_timer;
 	DSRUUTimer send_buf_timer;
 	DSRUUTimer neigh_tbl_timer;
 	DSRUUTimer lc_timer;
+	DSRUUTimer rreq_fwd_timer;
+	DSRUUTimer rreq_tbl_timer;
+	DSRUUTimer rreq_batch_timer;
+	DSRUUTimer ack_tbl_timer;
+	DSRUUTimer probe_timer;
 
 	/* The link cache */
 	struct lc_graph LC;
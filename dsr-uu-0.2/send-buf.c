@@ -31,41 +31,89 @@
 #ifdef __KERNEL__
 #define SEND_BUF_PROC_FS_NAME "send_buf"
 
+/* All packets in age order. Each packet is also queued on its destination's
+ * queue in send_buf_qtbl. Both are protected by the send_buf lock. */
 TBL(send_buf, SEND_BUF_MAX_LEN);
+static list_t send_buf_qtbl[SEND_BUF_HASH_SIZE];
+static struct send_buf_stats send_buf_stats;
 static DSRUUTimer send_buf_timer;
 static int send_buf_print(struct tbl *t, char *buffer);
 #endif
 
-struct send_buf_entry { // send_buff_entry 
-	list_t l;
-	struct dsr_pkt *dp;   //dsr路由协议数据包
-	struct timeval qtime;
-	xmit_fct_t okfn; 
-};
+static inline unsigned int send_buf_hash(struct in_addr dst)
+{
+	return (dst.s_addr ^ (dst.s_addr >> 16)) % SEND_BUF_HASH_SIZE;
+}
 
+static struct send_buf_queue *__send_buf_queue_find(list_t *bucket,
+						    struct in_addr dst)
+{
+	list_t *pos;
 
-static inline int crit_addr(void *pos, void *addr) //判断address是否一致?
-{ 
-	struct in_addr *a = (struct in_addr *)addr;
-	struct send_buf_entry *e = (struct send_buf_entry *)pos;
+	list_for_each(pos, bucket) {
+		struct send_buf_queue *q = (struct send_buf_queue *)pos;
 
-	if (e->dp->dst.s_addr == a->s_addr)
-		return 1;
-	return 0;
+		if (q->dst.s_addr == dst.s_addr)
+			return q;
+	}
+	return NULL;
 }
 
-static inline int crit_garbage(void *pos, void *n)
+/* The queue holding the most bytes, other than skip */
+static struct send_buf_queue *__send_buf_queue_longest(list_t *qtbl,
+						       struct send_buf_queue *skip)
 {
-	struct timeval *now = (struct timeval *)n;
-	struct send_buf_entry *e = (struct send_buf_entry *)pos;
+	struct send_buf_queue *max = NULL;
+	list_t *pos;
+	int i;
 
-	if (timeval_diff(now, &e->qtime) >=
-	    (int)ConfValToUsecs(SendBufferTimeout)) {
-		if (e->dp)
-			dsr_pkt_free(e->dp);
-		return 1;
+	for (i = 0; i < SEND_BUF_HASH_SIZE; i++) {
+		list_for_each(pos, &qtbl[i]) {
+			struct send_buf_queue *q = (struct send_buf_queue *)pos;
+
+			if (q == skip)
+				continue;
+
+			if (!max || q->bytes > max->bytes)
+				max = q;
+		}
+	}
+	return max;
+}
+
+/* Remove an entry from its destination queue, freeing the queue when it
+ * becomes empty */
+static inline void __send_buf_queue_unlink(struct send_buf_entry *e)
+{
+	struct send_buf_queue *q = e->q;
+
+	list_del(&e->dl);
+	q->bytes -= e->bytes;
+
+	if (--q->len == 0) {
+		list_del(&q->l);
+		FREE(q);
+	}
+}
+
+/* Remove an entry from both the age list and its destination queue */
+void NSCLASS __send_buf_entry_detach(struct send_buf_entry *e)
+{
+	__tbl_detach(&send_buf, &e->l);
+	send_buf_stats.bytes -= e->bytes;
+	__send_buf_queue_unlink(e);
+}
+
+static inline void send_buf_entries_free(list_t *pkts)
+{
+	list_t *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, pkts) {
+		struct send_buf_entry *e = (struct send_buf_entry *)pos;
+
+		dsr_pkt_free(e->dp);
+		FREE(e);
 	}
-	return 0;
 }
 
 void NSCLASS send_buf_set_max_len(unsigned int max_len) //设定缓冲区最大容?
@@ -76,36 +124,52 @@ void NSCLASS send_buf_set_max_len(unsigned int max_len) //设定缓冲区最大
 void NSCLASS send_buf_timeout(unsigned long data) //设置缓冲区超时时?
 {
 	struct send_buf_entry *e;
-	int pkts;
+	list_t expired;
+	int pkts = 0, rearm = 0;
+	long timeout;
 	struct timeval expires, now;
-/* 	char buf[2048]; */
 
 	gettime(&now);
 
-/* 	send_buf_print(&send_buf, buf); */
-/* 	DEBUG("\n%s\n", buf); */
+	timeout = ConfValToUsecs(SendBufferTimeout);
 
-	pkts = tbl_for_each_del(&send_buf, &now, crit_garbage);
+	INIT_LIST(&expired);
 
-	DEBUG("%d packets garbage collected\n", pkts);
+	DSR_WRITE_LOCK(&send_buf.lock);
 
-	DSR_READ_LOCK(&send_buf.lock);
-	/* Get first packet in maintenance buffer */
-	e = (struct send_buf_entry *)__tbl_find(&send_buf, NULL, crit_none);
+	/* Packets are added at the tail of the age list, so only the expired
+	 * ones at the head need to be looked at */
+	while (!TBL_EMPTY(&send_buf)) {
+		e = (struct send_buf_entry *)TBL_FIRST(&send_buf);
 
-	if (!e) {
-		DEBUG("No packet to set timeout for\n");
-		DSR_READ_UNLOCK(&send_buf.lock);
-		return;
+		if (timeval_diff(&now, &e->qtime) < timeout)
+			break;
+
+		__send_buf_entry_detach(e);
+		list_add_tail(&e->l, &expired);
+		pkts++;
+	}
+	send_buf_stats.timeouts += pkts;
+
+	/* Next expiry is that of the new head */
+	if (!TBL_EMPTY(&send_buf)) {
+		e = (struct send_buf_entry *)TBL_FIRST(&send_buf);
+		expires = e->qtime;
+		timeval_add_usecs(&expires, timeout);
+		set_timer(&send_buf_timer, &expires);
+		rearm = 1;
 	}
-	expires = e->qtime;
+	DSR_WRITE_UNLOCK(&send_buf.lock);
 
-	timeval_add_usecs(&expires, ConfValToUsecs(SendBufferTimeout));
+	send_buf_entries_free(&expired);
 
-	DEBUG("now=%s qtime=%s exp=%s\n", print_timeval(&now), print_timeval(&e->qtime), print_timeval(&expires));
-	DSR_READ_UNLOCK(&send_buf.lock);
+	DEBUG("%d packets garbage collected\n", pkts);
 
-	set_timer(&send_buf_timer, &expires);
+	if (!rearm) {
+		DEBUG("No packet to set timeout for\n");
+		return;
+	}
+	DEBUG("now=%s exp=%s\n", print_timeval(&now), print_timeval(&expires));
 }
 
 static struct send_buf_entry *send_buf_entry_create(struct dsr_pkt *dp,
@@ -120,20 +184,30 @@ static struct send_buf_entry *send_buf_entry_create(struct dsr_pkt *dp,
 
 	e->dp = dp;
 	e->okfn = okfn;
+#ifdef NS2
+	e->bytes = IP_HDR_LEN + dp->payload_len;
+#else
+	/* Account for the memory actually held */
+	e->bytes = dp->skb ? dp->skb->truesize : dp->payload_len;
+#endif
 	gettime(&e->qtime);
 
 	return e;
 }
 
+/* When the buffer is out of space, packets are dropped from the head of the
+ * longest queue (in bytes) so that a destination that never answers cannot
+ * push out the packets of all the others. Each destination is also limited
+ * to SendBufferDstSize packets. */
 int NSCLASS send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn)
 {
-	struct send_buf_entry *e;
+	struct send_buf_entry *e, *f;
+	struct send_buf_queue *q;
+	list_t *bucket, drops;
 	struct timeval expires;
+	unsigned int max_bytes, max_dst;
 	int res, empty = 0;
 
-	if (tbl_empty(&send_buf))
-		empty = 1;
-
 	e = send_buf_entry_create(dp, okfn);
 
 	if (!e)
@@ -141,99 +215,217 @@ int NSCLASS send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn)
 
 	DEBUG("enqueing packet to %s\n", print_ip(dp->dst));
 
-	res = tbl_add_tail(&send_buf, &e->l);
+	max_bytes = ConfVal(SendBufferBytes);
+	max_dst = ConfVal(SendBufferDstSize);
 
-	if (res < 0) {
-		struct send_buf_entry *f;
+	bucket = &send_buf_qtbl[send_buf_hash(dp->dst)];
+
+	INIT_LIST(&drops);
+
+	DSR_WRITE_LOCK(&send_buf.lock);
 
-		DEBUG("buffer full, removing first\n");
-		f = (struct send_buf_entry *)tbl_detach_first(&send_buf);
+	if (max_bytes && e->bytes > max_bytes) {
+		DEBUG("Packet larger than send buffer\n");
+		res = -ENOSPC;
+		goto out_err;
+	}
+
+	if (TBL_EMPTY(&send_buf))
+		empty = 1;
 
-		if (f) {
-			dsr_pkt_free(f->dp);
-			FREE(f);
+	q = __send_buf_queue_find(bucket, dp->dst);
+
+	if (!q) {
+		q = (struct send_buf_queue *)MALLOC(sizeof(*q), GFP_ATOMIC);
+
+		if (!q) {
+			res = -ENOMEM;
+			goto out_err;
 		}
+		q->dst = dp->dst;
+		q->len = 0;
+		q->bytes = 0;
+		INIT_LIST(&q->pkts);
+		list_add(&q->l, bucket);
+	}
 
-		res = tbl_add_tail(&send_buf, &e->l);
+	/* Queue the packet first so that its queue is not freed below */
+	e->q = q;
+	list_add_tail(&e->dl, &q->pkts);
+	q->len++;
+	q->bytes += e->bytes;
+
+	if (max_dst && q->len > max_dst) {
+		f = list_entry(q->pkts.next, struct send_buf_entry, dl);
+		__send_buf_entry_detach(f);
+		list_add_tail(&f->l, &drops);
+		send_buf_stats.dst_drops++;
+	}
 
-		if (res < 0) {
-			DEBUG("Could not buffer packet\n");
-			FREE(e);
-			return -1;
+	while (TBL_FULL(&send_buf) ||
+	       (max_bytes && send_buf_stats.bytes + e->bytes > max_bytes)) {
+		/* The queue of the new packet is a victim only if it holds
+		 * older packets too */
+		q = __send_buf_queue_longest(send_buf_qtbl,
+					     e->q->len == 1 ? e->q : NULL);
+
+		if (!q) {
+			DEBUG("buffer full, no room for packet\n");
+			__send_buf_queue_unlink(e);
+			res = -ENOSPC;
+			goto out_err;
 		}
+		f = list_entry(q->pkts.next, struct send_buf_entry, dl);
+
+		DEBUG("buffer full, dropping from queue to %s\n",
+		      print_ip(q->dst));
+		__send_buf_entry_detach(f);
+		list_add_tail(&f->l, &drops);
+		send_buf_stats.overflow_drops++;
+	}
+
+	res = __tbl_add_tail(&send_buf, &e->l);
+
+	if (res < 0) {
+		DEBUG("Could not buffer packet\n");
+		__send_buf_queue_unlink(e);
+		goto out_err;
 	}
+	send_buf_stats.bytes += e->bytes;
+	send_buf_stats.enqueued++;
 
+	/* Under the lock, so that send_buf_set_verdict() cannot see the
+	 * buffer empty and delete the timer after it is armed */
 	if (empty) {
 		gettime(&expires);
 		timeval_add_usecs(&expires, ConfValToUsecs(SendBufferTimeout));
 		set_timer(&send_buf_timer, &expires);
 	}
 
+	DSR_WRITE_UNLOCK(&send_buf.lock);
+
+	send_buf_entries_free(&drops);
+
+	return res;
+
+ out_err:
+	send_buf_stats.overflow_drops++;
+	DSR_WRITE_UNLOCK(&send_buf.lock);
+	send_buf_entries_free(&drops);
+	FREE(e);
 	return res;
 }
 
+/* Detach all packets queued for dst and link them on "pkts" through their
+ * age list link, oldest first */
+int NSCLASS __send_buf_queue_detach(struct in_addr dst, list_t *pkts)
+{
+	struct send_buf_queue *q;
+	list_t *pos, *tmp;
+	int n = 0;
+
+	q = __send_buf_queue_find(&send_buf_qtbl[send_buf_hash(dst)], dst);
+
+	if (!q)
+		return 0;
+
+	list_for_each_safe(pos, tmp, &q->pkts) {
+		struct send_buf_entry *e;
+
+		e = list_entry(pos, struct send_buf_entry, dl);
+
+		__tbl_detach(&send_buf, &e->l);
+		list_add_tail(&e->l, pkts);
+		n++;
+	}
+	send_buf_stats.bytes -= q->bytes;
+
+	list_del(&q->l);
+	FREE(q);
+
+	return n;
+}
+
 int NSCLASS send_buf_set_verdict(int verdict, struct in_addr dst)
 {
 	struct send_buf_entry *e;
-	int pkts = 0;
+	list_t pkts, *pos, *tmp;
+	int n, pkts_sent = 0, res = 0;
+
+	INIT_LIST(&pkts);
+
+	DSR_WRITE_LOCK(&send_buf.lock);
+	n = __send_buf_queue_detach(dst, &pkts);
+
+	/* Nothing left to expire. Decided under the lock, since an enqueue
+	 * into the empty buffer arms the timer again. */
+	if (n && TBL_EMPTY(&send_buf) && timer_pending(&send_buf_timer))
+		del_timer(&send_buf_timer);
+
+	DSR_WRITE_UNLOCK(&send_buf.lock);
+
+	if (n == 0)
+		return 0;
 
 	switch (verdict) {
 	case SEND_BUF_DROP:
 
-		while ((e =
-			(struct send_buf_entry *)tbl_find_detach(&send_buf,
-								 &dst,
-								 crit_addr))) {
+		list_for_each_safe(pos, tmp, &pkts) {
+			e = (struct send_buf_entry *)pos;
 			/* Only send one ICMP message */
 #ifdef __KERNEL__
-			if (pkts == 0)
+			if (pos == pkts.next)
 				icmp_send(e->dp->skb, ICMP_DEST_UNREACH,
 					  ICMP_HOST_UNREACH, 0);
 #endif
 			dsr_pkt_free(e->dp);
 			FREE(e);
-			pkts++;
 		}
-		DEBUG("Dropped %d queued pkts for %s\n", pkts, print_ip(dst));
+		DEBUG("Dropped %d queued pkts for %s\n", n, print_ip(dst));
 		break;
 	case SEND_BUF_SEND:
 
-		while ((e =
-			(struct send_buf_entry *)tbl_find_detach(&send_buf,
-								 &dst,
-								 crit_addr))) {
-			DEBUG("Send packet\n");
-			/* Get source route */
-			e->dp->srt = dsr_rtc_find(e->dp->src, e->dp->dst);
+		list_for_each_safe(pos, tmp, &pkts) {
+			e = (struct send_buf_entry *)pos;
 
-			if (e->dp->srt) {
+			/* The first packet looks up the route. The rest reuse
+			 * the option template it leaves behind. */
+			if (res != -EHOSTUNREACH)
+				res = dsr_srt_tmpl_add(e->dp);
 
-				if (dsr_srt_add(e->dp) < 0) {
-					DEBUG("Could not add source route\n");
-					dsr_pkt_free(e->dp);
-				} else
-					/* Send packet */
+			if (res == 0) {
+				/* Send packet */
 #ifdef NS2
-					(this->*e->okfn) (e->dp);
+				(this->*e->okfn) (e->dp);
 #else
-					e->okfn(e->dp);
+				e->okfn(e->dp);
 #endif
+				pkts_sent++;
 			} else {
-				DEBUG("No source route found for %s!\n",
-				      print_ip(dst));
+				if (res == -EHOSTUNREACH)
+					DEBUG("No source route found for %s!\n",
+					      print_ip(dst));
+				else
+					DEBUG("Could not add source route\n");
 
 				dsr_pkt_free(e->dp);
 			}
-			pkts++;
 			FREE(e);
 		}
-		DEBUG("Sent %d queued packets to %s\n", pkts, print_ip(dst));
-
-		/*      if (pkts == 0) */
-/* 			DEBUG("No packets for dest %s\n", print_ip(dst)); */
+		DEBUG("Sent %d queued packets to %s\n", pkts_sent,
+		      print_ip(dst));
 		break;
 	}
-	return pkts;
+
+	DSR_WRITE_LOCK(&send_buf.lock);
+	if (verdict == SEND_BUF_SEND) {
+		send_buf_stats.sent += pkts_sent;
+		send_buf_stats.noroute_drops += n - pkts_sent;
+	} else
+		send_buf_stats.noroute_drops += n;
+	DSR_WRITE_UNLOCK(&send_buf.lock);
+
+	return n;
 }
 
 static inline int send_buf_flush(struct tbl *t) //释放缓冲?
@@ -241,8 +433,8 @@ static inline int send_buf_flush(struct tbl *t) //释放缓冲?
 	struct send_buf_entry *e;
 	int pkts = 0;
 	/* Flush send buffer */
-	while ((e =
-		(struct send_buf_entry *)tbl_find_detach(t, NULL, crit_none))) {
+	while ((e = (struct send_buf_entry *)tbl_detach_first(t))) {
+		__send_buf_queue_unlink(e);
 		dsr_pkt_free(e->dp);
 		FREE(e);
 		pkts++;
@@ -274,7 +466,21 @@ static int send_buf_print(struct tbl *t, char *buffer)
 
 	len += sprintf(buffer + len,
 		       "\nQueue length      : %u\n"
-		       "Queue max. length : %u\n", t->len, t->max_len);
+		       "Queue max. length : %u\n"
+		       "Queue bytes       : %u\n"
+		       "Queue max. bytes  : %u\n"
+		       "Max. per dest.    : %u\n"
+		       "\nEnqueued          : %lu\n"
+		       "Sent              : %lu\n"
+		       "Timed out         : %lu\n"
+		       "Overflow drops    : %lu\n"
+		       "Per dest. drops   : %lu\n"
+		       "No route drops    : %lu\n",
+		       t->len, t->max_len, send_buf_stats.bytes,
+		       ConfVal(SendBufferBytes), ConfVal(SendBufferDstSize),
+		       send_buf_stats.enqueued, send_buf_stats.sent,
+		       send_buf_stats.timeouts, send_buf_stats.overflow_drops,
+		       send_buf_stats.dst_drops, send_buf_stats.noroute_drops);
 
 	DSR_READ_UNLOCK(&t->lock);
 
@@ -302,6 +508,7 @@ send_buf_get_info(char *buffer, char **start, off_t offset, int length) //返回
 
 int __init NSCLASS send_buf_init(void) //初始化缓冲区
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 
@@ -315,6 +522,10 @@ int __init NSCLASS send_buf_init(void) //初始化缓冲区
 #endif
 
 	INIT_TBL(&send_buf, SEND_BUF_MAX_LEN);
+	memset(&send_buf_stats, 0, sizeof(send_buf_stats));
+
+	for (i = 0; i < SEND_BUF_HASH_SIZE; i++)
+		INIT_LIST(&send_buf_qtbl[i]);
 
 	init_timer(&send_buf_timer);
 
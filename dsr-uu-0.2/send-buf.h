@@ -9,12 +9,24 @@
 #define _SEND_BUF_H
 
 #include "dsr.h"
+#include "tbl.h"
 
 #ifndef NO_GLOBALS
 
 #define SEND_BUF_DROP 1
 #define SEND_BUF_SEND 2
 
+#define SEND_BUF_HASH_SIZE 32
+
+/* Packets buffered for a destination, oldest first */
+struct send_buf_queue {
+	list_t l;		/* Hash bucket */
+	list_t pkts;
+	struct in_addr dst;
+	unsigned int len;
+	unsigned int bytes;
+};
+
 #ifdef NS2
 #include "ns-agent.h"
 typedef void (DSRUU::*xmit_fct_t) (struct dsr_pkt *);
@@ -22,6 +34,26 @@ typedef void (DSRUU::*xmit_fct_t) (struct dsr_pkt *);
 typedef int (*xmit_fct_t) (struct dsr_pkt *);
 #endif
 
+struct send_buf_entry {
+	list_t l;		/* Age list */
+	list_t dl;		/* Destination queue */
+	struct send_buf_queue *q;
+	struct dsr_pkt *dp;
+	struct timeval qtime;
+	unsigned int bytes;
+	xmit_fct_t okfn; 
+};
+
+struct send_buf_stats {
+	unsigned int bytes;	/* Currently buffered */
+	unsigned long enqueued;
+	unsigned long sent;
+	unsigned long timeouts;
+	unsigned long overflow_drops;
+	unsigned long dst_drops;
+	unsigned long noroute_drops;
+};
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
@@ -30,6 +62,8 @@ void send_buf_set_max_len(unsigned int max_len);
 int send_buf_find(struct in_addr dst);
 int send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn);
 int send_buf_set_verdict(int verdict, struct in_addr dst);
+void __send_buf_entry_detach(struct send_buf_entry *e);
+int __send_buf_queue_detach(struct in_addr dst, list_t *pkts);
 int send_buf_init(void);
 void send_buf_cleanup(void);
 void send_buf_timeout(unsigned long data);
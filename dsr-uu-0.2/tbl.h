@@ -34,6 +34,7 @@
 
 typedef struct list_head list_t;
 #define LIST_INIT_HEAD(name) LIST_HEAD_INIT(name)
+#define INIT_LIST(h) INIT_LIST_HEAD(h)
 
 #define TBL_INIT(name, max_len) { LIST_INIT_HEAD(name.head), \
                                  0, \